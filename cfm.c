@@ -8,16 +8,22 @@
 
 #ifdef __APPLE__
 # define _DARWIN_C_SOURCE
+# define st_mtim st_mtimespec
+# define st_ctim st_ctimespec
 #elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 # define __BSD_VISIBLE 1
+#elif defined(__linux__)
+# define _DEFAULT_SOURCE
 #endif
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -26,8 +32,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#ifdef __linux__
+# include <linux/fs.h>
+# include <sys/inotify.h>
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -55,6 +68,28 @@
 #define KEY_PGDN 'J'
 
 #define LIST_ALLOC_SIZE 64
+#define NAMES_ALLOC_SIZE 4096
+
+// size of the buffer handed to getdents64(2) when reading directories
+#define DENTS_BUF_SIZE (256 * 1024)
+
+// number of entries read between checks for input while loading a directory
+#define SCAN_BATCH 1024
+
+// how often (in ms) the status line is updated while loading a directory
+#define SCAN_STATUS_MS 100
+
+// size of the buffer used to copy files when the kernel can't do it for us
+#define COPY_BUF_SIZE (128 * 1024)
+
+// most bytes handed to copy_file_range(2) or sendfile(2) at once
+#define COPY_CHUNK (1L << 30)
+
+// directories with fewer entries than this are sorted on one thread
+#define SORT_PARALLEL_MIN 65536
+
+// most threads used to sort one directory
+#define SORT_THREADS_MAX 64
 
 #ifndef POINTER
 # define POINTER "->"
@@ -99,6 +134,41 @@
 # define ABBREVIATE_HOME 1
 #endif
 
+#ifndef LAZY_STAT
+# define LAZY_STAT 1
+#endif
+
+#ifndef CACHE_SIZE
+# define CACHE_SIZE 64
+#endif
+
+#ifndef FILE_INDEX
+# define FILE_INDEX 1
+#endif
+
+#ifndef COPY_THREADS
+# define COPY_THREADS 8
+#endif
+
+#ifndef IO_URING
+# define IO_URING 1
+#endif
+
+// io_uring needs kernel headers which know about everything used here
+#if IO_URING && defined(__linux__) && defined(SYS_io_uring_setup) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+# endif
+#endif
+#if IO_URING && !defined(IO_URING_OP_SUPPORTED)
+# undef IO_URING
+# define IO_URING 0
+#endif
+
+// number of entries past the visible ones to classify when using LAZY_STAT
+#define LAZY_READAHEAD 32
+
 #ifdef VIEW_COUNT
 # if VIEW_COUNT > 10
 #  undef VIEW_COUNT
@@ -129,10 +199,54 @@ static const char* elemtypestrings[] = {
     "file",
 };
 
+/*
+ * An entry in a listing. Its name is kept in the listing's names, so that an
+ * entry is only a few bytes, and large directories can be sorted and drawn
+ * without walking through mostly empty name buffers.
+ */
 struct listelem {
-    enum elemtype type;
-    char name[NAME_MAX+1];
+    uint32_t name; // offset of the entry's key and name in the listing's names
+    uint32_t id; // index of the entry's info, if the listing has any
+    unsigned char type; // enum elemtype
     bool marked;
+    bool pending; // type is not final until resolve() is called
+};
+
+enum sortmode {
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_TIME,
+    SORT_EXT,
+    SORT_MODES,
+};
+
+static const char* sortmodestrings[] = {
+    "name",
+    "size",
+    "time",
+    "extension",
+};
+
+// whether a sort mode needs the size and time of each entry
+#define SORT_NEEDS_INFO(m) ((m) == SORT_SIZE || (m) == SORT_TIME)
+
+/*
+ * What is kept from stat for each entry when sorting by size or time. Entries
+ * refer to it by id, so it doesn't have to be moved around when sorting.
+ */
+struct entryinfo {
+    int64_t size;
+    int64_t mtime; // in nanoseconds
+};
+
+/*
+ * The names of the entries in a listing, stored back to back along with
+ * their sort keys.
+ */
+struct names {
+    char* buf;
+    size_t len;
+    size_t size;
 };
 
 #define E_DIR(t) ((t)==ELEM_DIR || (t)==ELEM_DIRLINK)
@@ -142,6 +256,7 @@ static int mdel_id = 0;
 
 struct deletedfile {
     char* original;
+    const char* trash; // the trash directory it's kept in
     int id;
     bool mass;
     int massid;
@@ -162,97 +277,527 @@ static char editor[PATH_MAX+1];
 static char opener[PATH_MAX+1];
 static char shell[PATH_MAX+1];
 static char tmpdir[PATH_MAX+1];
+static dev_t tmpdev;
+
+/*
+ * Trash directories on filesystems other than the one tmpdir is on, see
+ * trashfor().
+ */
+static struct trash {
+    dev_t dev;
+    char path[PATH_MAX+1];
+    struct trash* next;
+}* trashes;
 static char cdonclosefile[PATH_MAX+1];
 
 static atomic_bool interactive = true;
 
+// the limit on open files cfm was started with, which children get back
+static struct rlimit nofile;
+
 /*
- * Hash table for files created by the copy function.
- * The source for this was heavily inspired by libbb since I am too
- * lazy to make my own entirely from scratch.
+ * A set of files, keyed by device and inode, using open addressing. Each one
+ * can carry a value for whoever owns the set.
  */
-#define HASH_SIZE 311U // prime number
-#define hashfn(ino) ((unsigned)(ino) % HASH_SIZE)
-
-struct hashed_file {
-    ino_t ino;
+struct inoslot {
     dev_t dev;
-    struct hashed_file* next;
-    bool isdir;
+    ino_t ino;
+    uint32_t val;
+    bool used;
+};
+
+struct inoset {
+    struct inoslot* slots;
+    size_t count;
+    size_t size; // always a power of two
 };
 
-static struct hashed_file** file_table;
+#define INOSET_MIN 1024
+
+static size_t inohash(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32) ^ (uint64_t)dev) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 29));
+}
 
 /*
- * Returns whether or not a file is in the hash table.
+ * Returns the slot for a file, or NULL if it isn't in the set.
  */
-static bool is_file_hashed(const struct stat* st) {
-    if (!file_table) {
-        return false;
+static struct inoslot* inoset_find(const struct inoset* s, dev_t dev, ino_t ino) {
+    if (!s->count) {
+        return NULL;
     }
-    struct hashed_file* elem = file_table[hashfn(st->st_ino)];
-    while (elem != NULL) {
-        if (elem->ino == st->st_ino
-                && elem->dev == st->st_dev
-                && elem->isdir == !!S_ISDIR(st->st_mode)) {
-            return true;
+    for (size_t i = inohash(dev, ino) & (s->size - 1); s->slots[i].used; i = (i + 1) & (s->size - 1)) {
+        if (s->slots[i].ino == ino && s->slots[i].dev == dev) {
+            return &s->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the slot for a file, adding it with a value of 0 if it isn't in the
+ * set yet. added tells which happened.
+ */
+static struct inoslot* inoset_add(struct inoset* s, dev_t dev, ino_t ino, bool* added) {
+    // keep the set at most three quarters full
+    if ((s->count + 1) * 4 > s->size * 3) {
+        size_t size = s->size ? s->size * 2 : INOSET_MIN;
+        struct inoslot* slots = calloc(size, sizeof(*slots));
+        if (!slots) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < s->size; i++) {
+            if (s->slots[i].used) {
+                size_t j = inohash(s->slots[i].dev, s->slots[i].ino) & (size - 1);
+                while (slots[j].used) {
+                    j = (j + 1) & (size - 1);
+                }
+                slots[j] = s->slots[i];
+            }
         }
-        elem = elem->next;
+        free(s->slots);
+        s->slots = slots;
+        s->size = size;
+    }
+
+    size_t i = inohash(dev, ino) & (s->size - 1);
+    for (; s->slots[i].used; i = (i + 1) & (s->size - 1)) {
+        if (s->slots[i].ino == ino && s->slots[i].dev == dev) {
+            *added = false;
+            return &s->slots[i];
+        }
+    }
+    s->slots[i] = (struct inoslot){ dev, ino, 0, true };
+    s->count++;
+    *added = true;
+    return &s->slots[i];
+}
+
+/*
+ * Empties a set and frees its memory.
+ */
+static void inoset_free(struct inoset* s) {
+    free(s->slots);
+    *s = (struct inoset){0};
+}
+
+/*
+ * Hashes a name into a key for an inoset, so that one can be used to look up
+ * names or paths. The two halves are hashed differently, which makes it
+ * unlikely for different names to have the same key, but not impossible, so
+ * whatever a key finds mustn't be taken to be for that name alone.
+ */
+static void namekey(const char* name, dev_t* dev, ino_t* ino) {
+    uint64_t a = 0xcbf29ce484222325ULL;
+    uint64_t b = 0x84222325cbf29ce4ULL;
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        a = (a ^ *c) * 0x100000001b3ULL;
+        b = (b + *c) * 0x9E3779B97F4A7C15ULL;
+        b ^= b >> 31;
+    }
+    *dev = (dev_t)b;
+    *ino = (ino_t)a;
+}
+
+/*
+ * Counters for the syscalls made while reading a directory.
+ */
+struct liststats {
+    size_t entries;
+    size_t getdents;
+    size_t stats;
+    size_t links;
+    bool cached;
+};
+
+/*
+ * Bulk directory reader. On Linux, entries are read straight from the kernel
+ * with getdents64(2) into a large buffer, which saves a lot of syscalls on big
+ * directories. Elsewhere, this wraps readdir(3).
+ */
+struct dirreader {
+    int fd;
+    struct liststats* stats;
+#ifdef __linux__
+    char* buf;
+    size_t len;
+    size_t off;
+#else
+    DIR* d;
+#endif
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#ifndef DT_UNKNOWN
+# define DT_UNKNOWN 0
+#endif
+
+/*
+ * Opens a directory relative to dfd for reading, with extra open flags.
+ * Returns 0 on success, else -1 and sets errno.
+ */
+static int dr_openat(struct dirreader* r, int dfd, const char* path, int flags, struct liststats* stats) {
+    r->stats = stats;
+    r->fd = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+    if (r->fd < 0) {
+        return -1;
+    }
+#ifdef __linux__
+    r->buf = NULL;
+    r->len = r->off = 0;
+#else
+    r->d = fdopendir(r->fd);
+    if (!r->d) {
+        int e = errno;
+        close(r->fd);
+        errno = e;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Opens a directory for reading.
+ * Returns 0 on success, else -1 and sets errno.
+ */
+static int dr_open(struct dirreader* r, const char* path, struct liststats* stats) {
+    return dr_openat(r, AT_FDCWD, path, 0, stats);
+}
+
+/*
+ * Gets the next entry from a directory, storing its name and d_type.
+ * Returns false at the end of the directory or on error.
+ */
+static bool dr_next(struct dirreader* r, const char** name, unsigned char* type) {
+#ifdef __linux__
+    if (r->off >= r->len) {
+        if (!r->buf && !(r->buf = malloc(DENTS_BUF_SIZE))) {
+            return false;
+        }
+        long n = syscall(SYS_getdents64, r->fd, r->buf, DENTS_BUF_SIZE);
+        r->stats->getdents++;
+        if (n <= 0) {
+            return false;
+        }
+        r->len = n;
+        r->off = 0;
+    }
+    struct linux_dirent64* de = (struct linux_dirent64*)(r->buf + r->off);
+    r->off += de->d_reclen;
+    *name = de->d_name;
+    *type = de->d_type;
+    return true;
+#else
+    struct dirent* de = readdir(r->d);
+    if (!de) {
+        return false;
+    }
+    *name = de->d_name;
+# ifdef DT_DIR
+    *type = de->d_type;
+# else
+    *type = DT_UNKNOWN;
+# endif
+    return true;
+#endif
+}
+
+static void dr_close(struct dirreader* r) {
+#ifdef __linux__
+    free(r->buf);
+    close(r->fd);
+#else
+    closedir(r->d);
+#endif
+}
+
+/*
+ * Totals for the last copy, for showing its progress and once it's done, and
+ * for the last delete. Setting cancel stops either as soon as it notices.
+ */
+static struct {
+    atomic_size_t files;
+    atomic_int_fast64_t bytes;
+    atomic_int_fast64_t skipped; // in holes, which weren't copied
+    atomic_size_t links; // files linked to others rather than copied
+    atomic_bool top; // whether the top of the copy was created
+    atomic_size_t removed; // by the delete
+    atomic_bool cancel;
+} copystats;
+
+static bool cancelled(void) {
+    if (atomic_load_explicit(&copystats.cancel, memory_order_relaxed)) {
+        errno = ECANCELED;
+        return true;
     }
     return false;
 }
 
 /*
- * Hashes a file and adds it to the hash table.
+ * A walk through a directory tree which doesn't recurse, so that however deep
+ * the tree is, only the directory the walk is in is kept open. Each level
+ * down remembers which directory it is, so that the walk can go back up
+ * through "..", and the names of the directories in it still to be walked
+ * are kept one after another in names, those of the deepest level last.
+ */
+struct treewalk {
+    int fd; // the directory the walk is in, or top once it's left the tree
+    int top;
+    const char* name; // of the tree, in top
+    const dev_t* dev; // the only filesystem walked, if not NULL
+    struct twlevel {
+        dev_t dev;
+        ino_t ino;
+        size_t todo; // where its names start
+        bool removed; // whether anything in it was, for rmtreeat()
+    }* levels;
+    size_t depth;
+    size_t cap;
+    char* names;
+    size_t len;
+    size_t size;
+};
+
+/*
+ * Adds a directory to those still to be walked in the one the walk is in.
+ */
+static void tw_push(struct treewalk* w, const char* name) {
+    size_t len = strlen(name) + 1;
+    if (w->len + len > w->size) {
+        size_t size = w->size ? w->size : NAMES_ALLOC_SIZE;
+        while (size < w->len + len) {
+            size *= 2;
+        }
+        char* names = realloc(w->names, size);
+        if (!names) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        w->names = names;
+        w->size = size;
+    }
+    memcpy(w->names + w->len, name, len);
+    w->len += len;
+}
+
+/*
+ * Gets the directory which is to be walked next in the one the walk is in,
+ * or NULL if there are none left.
  */
-static void add_file_hash(const struct stat* st) {
-    struct hashed_file* elem = malloc(sizeof(struct hashed_file));
-    elem->ino = st->st_ino;
-    elem->dev = st->st_dev;
-    elem->isdir = !!S_ISDIR(st->st_mode);
-    if (!file_table) {
-        file_table = calloc(HASH_SIZE, sizeof(*file_table));
+static const char* tw_next(struct treewalk* w) {
+    size_t todo = w->levels[w->depth - 1].todo;
+    if (w->len == todo) {
+        return NULL;
     }
-    int i = hashfn(st->st_ino);
-    elem->next = file_table[i];
-    file_table[i] = elem;
+    size_t i = w->len - 1;
+    while (i > todo && w->names[i - 1]) {
+        i--;
+    }
+    return w->names + i;
 }
 
 /*
- * Cleans up the file table.
+ * Forgets the directory tw_next() returned.
  */
-static void reset_file_table(void) {
-    if (!file_table) {
-        return;
+static void tw_drop(struct treewalk* w) {
+    w->len = tw_next(w) - w->names;
+}
+
+/*
+ * Goes into the directory tw_next() returns, or into the top of the tree
+ * if the walk has left it, leaving the name where it is so that it can still
+ * be used once the walk comes back up.
+ * Returns 0 on success, else -1 and sets errno.
+ */
+static int tw_down(struct treewalk* w) {
+    struct stat st;
+    int fd = openat(w->fd, w->depth ? tw_next(w) : w->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (0 != fstat(fd, &st) || (w->dev && st.st_dev != *w->dev)) {
+        // another filesystem is mounted here
+        close(fd);
+        errno = EXDEV;
+        return -1;
+    }
+    if (w->depth == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : LIST_ALLOC_SIZE;
+        struct twlevel* levels = realloc(w->levels, cap * sizeof(*levels));
+        if (!levels) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        w->levels = levels;
+        w->cap = cap;
     }
+    if (w->depth) {
+        close(w->fd);
+    }
+    w->fd = fd;
+    w->levels[w->depth++] = (struct twlevel){ st.st_dev, st.st_ino, w->len, false };
+    return 0;
+}
 
-    struct hashed_file* elem;
-    struct hashed_file* next;
-    for (size_t i = 0; i < HASH_SIZE; i++) {
-        elem = file_table[i];
-        while (elem != NULL) {
-            next = elem->next;
-            free(elem);
-            elem = next;
+/*
+ * Goes back up to the directory the walk was in before its last tw_down(),
+ * which must still be the directory above.
+ * Returns 0 on success, else -1 and sets errno.
+ */
+static int tw_up(struct treewalk* w) {
+    struct stat st;
+    int fd = w->top;
+    if (w->depth > 1) {
+        struct twlevel* l = &w->levels[w->depth - 2];
+        fd = openat(w->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        if (0 != fstat(fd, &st) || st.st_dev != l->dev || st.st_ino != l->ino) {
+            // it's been moved
+            close(fd);
+            errno = ENOENT;
+            return -1;
         }
     }
-    free(file_table);
-    file_table = NULL;
+    close(w->fd);
+    w->fd = fd;
+    w->len = w->levels[--w->depth].todo;
+    return 0;
+}
+
+/*
+ * Starts walking the directory name in dfd, staying on the filesystem dev if
+ * it isn't NULL.
+ * Returns 0 on success, else -1 and sets errno.
+ */
+static int tw_start(struct treewalk* w, int dfd, const char* name, const dev_t* dev) {
+    *w = (struct treewalk){ .fd = dfd, .top = dfd, .name = name, .dev = dev };
+    return tw_down(w);
+}
+
+static void tw_end(struct treewalk* w) {
+    if (w->depth) {
+        close(w->fd);
+    }
+    free(w->levels);
+    free(w->names);
+    *w = (struct treewalk){0};
 }
 
 /*
- * Unlinks a file. Used for deldir.
+ * Removes the directory name in dfd and everything in it, without leaving the
+ * filesystem it's on (dev), working relative to each directory's descriptor
+ * so that no paths are built. It only keeps the directory it's in open, so
+ * trees of any depth can be removed.
+ * Returns 0 on success, else -1 with as much removed as could be.
  */
-static int rmFiles(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
-    (void)sbuf; (void)type; (void)ftwb;
-    return remove(pathname);
+static int rmtreeat(int dfd, const char* name, dev_t dev) {
+    struct liststats stats = {0};
+    struct treewalk w;
+    struct dirreader r;
+    const char* e;
+    unsigned char type;
+    struct stat st;
+    int s = 0;
+    bool scan = true;
+
+    if (0 != tw_start(&w, dfd, name, &dev)) {
+        return -1;
+    }
+    while (true) {
+        if (scan && 0 != dr_openat(&r, w.fd, ".", 0, &stats)) {
+            s = -1;
+        } else if (scan) {
+            while (dr_next(&r, &e, &type)) {
+                if (cancelled()) {
+                    dr_close(&r);
+                    tw_end(&w);
+                    return -1;
+                }
+                if (0 == strcmp(e, ".") || 0 == strcmp(e, "..")) {
+                    continue;
+                }
+#ifdef DT_DIR
+                if (type == DT_UNKNOWN) {
+                    type = (0 == fstatat(r.fd, e, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+                }
+                bool dir = type == DT_DIR;
+#else
+                bool dir = 0 == fstatat(r.fd, e, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+#endif
+                if (dir) {
+                    tw_push(&w, e);
+                } else if (0 == unlinkat(r.fd, e, 0)) {
+                    w.levels[w.depth - 1].removed = true;
+                    atomic_fetch_add(&copystats.removed, 1);
+                } else {
+                    s = -1;
+                }
+            }
+            dr_close(&r);
+        }
+        scan = false;
+
+        if (tw_next(&w)) {
+            if (0 == tw_down(&w)) {
+                scan = true;
+            } else {
+                s = -1;
+                tw_drop(&w);
+            }
+            continue;
+        }
+
+        // everything in this directory has been gone through
+        bool removed = w.levels[w.depth - 1].removed;
+        if (0 != tw_up(&w)) {
+            tw_end(&w);
+            return -1;
+        }
+        if (0 == unlinkat(w.fd, w.depth ? tw_next(&w) : name, AT_REMOVEDIR)) {
+            if (!w.depth) {
+                tw_end(&w);
+                return s;
+            }
+            w.levels[w.depth - 1].removed = true;
+            tw_drop(&w);
+            continue;
+        }
+        // some systems skip entries when a directory changes while it's being
+        // read, so it's read again as long as that gets anywhere
+        if (removed && (errno == ENOTEMPTY || errno == EEXIST) && 0 == tw_down(&w)) {
+            scan = true;
+        } else if (w.depth) {
+            s = -1;
+            tw_drop(&w);
+        } else {
+            tw_end(&w);
+            return -1;
+        }
+    }
 }
 
 /*
  * Deletes a directory, even if it contains files.
  */
 static int deldir(const char* dir) {
-    return nftw(dir, rmFiles, 512, FTW_DEPTH | FTW_MOUNT | FTW_PHYS);
+    struct stat st;
+    if (0 != lstat(dir, &st)) {
+        return -1;
+    }
+    return rmtreeat(AT_FDCWD, dir, st.st_dev);
 }
 
 /*
@@ -291,6 +836,31 @@ static int exists(const char* path) {
     }
 }
 
+/*
+ * Renames src to dst, failing with EEXIST instead of replacing dst if there is
+ * one. Fails with EXDEV if they're on different filesystems, in which case src
+ * can only be moved by copying it.
+ */
+static int movefile(const char* src, const char* dst) {
+#if defined(__linux__) && defined(SYS_renameat2) && defined(RENAME_NOREPLACE)
+    if (0 == syscall(SYS_renameat2, AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE)) {
+        return 0;
+    }
+    // old kernels and some filesystems can only rename the usual way
+    if (errno != ENOSYS && errno != EINVAL) {
+        return -1;
+    }
+#endif
+    int s = exists(dst);
+    if (s != 0) {
+        if (s == 1) {
+            errno = EEXIST;
+        }
+        return -1;
+    }
+    return rename(src, dst);
+}
+
 /*
  * Get the base name of a file.
  * This is the same thing as running `basename x/y/z` at
@@ -329,294 +899,571 @@ static void getrealcwd(char* buf, size_t size) {
 }
 
 /*
- * This is the internal portion. Use the cpfile function instead.
- * Copy file or directory recursively.
- * Returns 0 on success, -1 on error.
+ * A pool of threads sharing work by stealing it. Each worker has its own
+ * queue, which it takes the newest task from, so that it works depth first
+ * and keeps what it touches in cache. A worker whose queue is empty takes
+ * the oldest task from someone else's instead, which is likely to be the one
+ * with the most work below it. Tasks may queue more tasks, and the workers
+ * stop once nothing is queued or running.
  */
-static int cpfile_inner(const char* src, const char* dst) {
-    char* b = basename(src);
-    if (b && (0 == strcmp(b, ".") || 0 == strcmp(b, ".."))) {
-        return 0;
-    }
+#define POOL_THREADS_MAX 64
 
-    struct stat srcstat, dststat;
-    bool dstexist = false;
-    int s = 0;
+struct pool;
 
-    if (lstat(src, &srcstat) < 0) {
-        // couldn't stat source
-        return -1;
+struct pooltask {
+    void (*fn)(struct pool* p, size_t id, void* arg);
+    void* arg;
+};
+
+struct poolqueue {
+    pthread_mutex_t lock;
+    struct pooltask* items;
+    size_t head; // where others steal from
+    size_t tail; // where the owner pushes and pops
+    size_t size;
+};
+
+struct pool {
+    atomic_long tasks; // queued or running
+    pthread_mutex_t idlelock;
+    pthread_cond_t idle;
+    int sleeping;
+    size_t nqueues;
+    struct poolqueue queues[POOL_THREADS_MAX];
+};
+
+/*
+ * Sets up a pool for n workers, numbered from 0.
+ */
+static void pool_init(struct pool* p, size_t n) {
+    atomic_init(&p->tasks, 0);
+    pthread_mutex_init(&p->idlelock, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    p->sleeping = 0;
+    p->nqueues = (n < 1) ? 1 : (n > POOL_THREADS_MAX) ? POOL_THREADS_MAX : n;
+    for (size_t i = 0; i < p->nqueues; i++) {
+        p->queues[i] = (struct poolqueue){ .items = NULL };
+        pthread_mutex_init(&p->queues[i].lock, NULL);
     }
+}
 
-    // if we already created this file we don't want to create it again
-    if (is_file_hashed(&srcstat)) {
-        return 0;
+static void pool_destroy(struct pool* p) {
+    for (size_t i = 0; i < p->nqueues; i++) {
+        pthread_mutex_destroy(&p->queues[i].lock);
+        free(p->queues[i].items);
     }
+    pthread_mutex_destroy(&p->idlelock);
+    pthread_cond_destroy(&p->idle);
+}
 
-    if (lstat(dst, &dststat) < 0) {
-        // couldn't stat target
-        if (errno != ENOENT) {
-            return -1;
-        }
-    } else {
-        if (srcstat.st_dev == dststat.st_dev && srcstat.st_ino == dststat.st_ino) {
-            // same file
-            return -1;
+/*
+ * Queues a task on worker id's queue.
+ */
+static void pool_push(struct pool* p, size_t id, void (*fn)(struct pool*, size_t, void*), void* arg) {
+    struct poolqueue* q = &p->queues[id];
+    atomic_fetch_add(&p->tasks, 1);
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->size) {
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(*q->items));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            size_t size = q->size ? q->size * 2 : LIST_ALLOC_SIZE;
+            struct pooltask* items = realloc(q->items, size * sizeof(*items));
+            if (!items) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            q->items = items;
+            q->size = size;
         }
-        dstexist = true;
     }
+    q->items[q->tail++] = (struct pooltask){ fn, arg };
+    pthread_mutex_unlock(&q->lock);
 
-    if (dstexist) {
-        return -1;
+    pthread_mutex_lock(&p->idlelock);
+    if (p->sleeping) {
+        pthread_cond_signal(&p->idle);
     }
+    pthread_mutex_unlock(&p->idlelock);
+}
 
-    if (S_ISDIR(srcstat.st_mode)) {
-        mode_t smask = umask(0);
-        mode_t mode = srcstat.st_mode & ~smask;
-        mode |= S_IRWXU;
-        if (mkdir(dst, mode) < 0) {
-            umask(smask);
-            return -1;
+/*
+ * Takes a task for worker id, from its own queue or else from another's.
+ */
+static bool pool_take(struct pool* p, size_t id, struct pooltask* t) {
+    bool found = false;
+    struct poolqueue* q = &p->queues[id];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *t = q->items[--q->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (size_t i = 1; !found && i < p->nqueues; i++) {
+        q = &p->queues[(id + i) % p->nqueues];
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) {
+            *t = q->items[q->head++];
+            found = true;
         }
-        umask(smask);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return found;
+}
 
-        struct stat newst;
-        if (lstat(dst, &newst) < 0) {
-            return -1;
+/*
+ * Runs tasks as worker id until there are none left anywhere.
+ */
+static void pool_work(struct pool* p, size_t id) {
+    for (;;) {
+        struct pooltask t;
+        if (pool_take(p, id, &t)) {
+            t.fn(p, id, t.arg);
+            if (atomic_fetch_sub(&p->tasks, 1) == 1) {
+                pthread_mutex_lock(&p->idlelock);
+                pthread_cond_broadcast(&p->idle);
+                pthread_mutex_unlock(&p->idlelock);
+            }
+            continue;
         }
-        add_file_hash(&newst);
 
-        DIR* d = opendir(src);
-        if (d == NULL) {
-            s = -1;
-            goto preserve;
+        pthread_mutex_lock(&p->idlelock);
+        if (atomic_load(&p->tasks) == 0) {
+            pthread_mutex_unlock(&p->idlelock);
+            return;
         }
+        // someone may have queued something after it was looked for, so
+        // don't wait long
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10 * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        p->sleeping++;
+        pthread_cond_timedwait(&p->idle, &p->idlelock, &until);
+        p->sleeping--;
+        pthread_mutex_unlock(&p->idlelock);
+    }
+}
 
-        struct dirent* de;
-        while ((de = readdir(d)) != NULL) {
-            char *ns = malloc(PATH_MAX);
-            if (ns == NULL) {
-                s = -1;
-            }
+struct poolworker {
+    struct pool* pool;
+    size_t id;
+};
 
-            char *nd = malloc(PATH_MAX);
-            if (nd == NULL) {
-                free(ns);
-                s = -1;
-            }
+/*
+ * Body of a pool thread started by whoever set the pool up.
+ */
+static void* pool_thread(void* arg) {
+    struct poolworker* w = arg;
+    pool_work(w->pool, w->id);
+    return NULL;
+}
 
-            snprintf(ns, PATH_MAX, "%s/%s", src, de->d_name);
-            snprintf(nd, PATH_MAX, "%s/%s", dst, de->d_name);
-            if (cpfile_inner(ns, nd) != 0) {
-                s = -1;
+static struct deletedfile* newdeleted(bool mass) {
+    struct deletedfile* d = malloc(sizeof(struct deletedfile));
+    if (!d) {
+        return NULL;
+    }
+
+    d->original = malloc(PATH_MAX);
+    if (!d->original) {
+        free(d);
+        return NULL;
+    }
+
+    d->id = del_id++;
+    d->mass = mass;
+    if (d->mass) {
+        d->massid = mdel_id;
+    }
+    d->prev = NULL;
+
+    return d;
+}
+
+static struct deletedfile* freedeleted(struct deletedfile* f) {
+    struct deletedfile* d = f->prev;
+    free(f->original);
+    free(f);
+    return d;
+}
+
+/*
+ * Sort keys. Names are stored after a key which sorts the way they should be
+ * listed, so that sorting only needs memcmp(). Directories start with a 0 byte
+ * and everything else with a 1 so that directories come first, then the name
+ * follows with case folded, and each run of digits replaced by a marker and
+ * its value as a length-prefixed big-endian number, so that numbers sort by
+ * value and leading zeros don't matter. The marker is a digit, so that numbers
+ * sort against other characters the same way their digits would.
+ *
+ * An entry is laid out as a 2 byte key length, the key, then the name.
+ */
+#define KEY_MAX (1 + 3 * NAME_MAX)
+#define ENTRY_MAX (2 + KEY_MAX + NAME_MAX + 1)
+#define KEY_NUMBER '0'
+
+/*
+ * Writes the entry for a name to out, which must have room for ENTRY_MAX
+ * bytes. Returns its size.
+ */
+static size_t makeentry(char* out, bool dir, const char* name) {
+    unsigned char* k = (unsigned char*)out + 2;
+    size_t n = 0;
+
+    k[n++] = dir ? 0 : 1;
+    for (const char* c = name; *c; ) {
+        if (*c >= '0' && *c <= '9') {
+            unsigned long v = 0;
+            for (; *c >= '0' && *c <= '9'; c++) {
+                unsigned long d = *c - '0';
+                v = (v > (ULONG_MAX - d) / 10) ? ULONG_MAX : v * 10 + d;
             }
 
-            if (ns) free(ns);
-            if (nd) free(nd);
+            unsigned char len = 0;
+            for (unsigned long x = v; x; x >>= 8) {
+                len++;
+            }
+            k[n++] = KEY_NUMBER;
+            k[n++] = len;
+            while (len--) {
+                k[n++] = (v >> (len * 8)) & 0xFF;
+            }
+        } else {
+            k[n++] = toupper((unsigned char)*c);
+            c++;
         }
+    }
 
-        closedir(d);
+    uint16_t keylen = n;
+    memcpy(out, &keylen, sizeof(keylen));
 
-        chmod(dst, srcstat.st_mode & ~smask);
-        goto preserve;
-    }
+    size_t len = strlen(name) + 1;
+    memcpy(k + n, name, len);
 
-    if (S_ISREG(srcstat.st_mode)) {
-        int sfd, dfd;
-        mode_t nmode;
+    return 2 + n + len;
+}
 
-        if (S_ISLNK(srcstat.st_mode)) {
-            goto notreg;
-        }
+static uint16_t keylen(const char* e) {
+    uint16_t l;
+    memcpy(&l, e, sizeof(l));
+    return l;
+}
 
-        sfd = open(src, O_RDONLY);
-        if (sfd == -1) {
-            return -1;
-        }
+/*
+ * Returns the name of an entry.
+ */
+static char* entryname(char* e) {
+    return e + 2 + keylen(e);
+}
 
-        nmode = srcstat.st_mode;
-        if (!S_ISREG(srcstat.st_mode)) {
-            nmode = 0666;
-        }
+/*
+ * Returns the size of an entry.
+ */
+static size_t entrysize(char* e) {
+    return 2 + keylen(e) + strlen(entryname(e)) + 1;
+}
 
-        dfd = open(dst, O_WRONLY|O_CREAT|O_EXCL, nmode);
-        if (dfd == -1) {
-            close(sfd);
-            return -1;
-        }
+/*
+ * Compares two entries by their keys, and if those are the same, by their
+ * names, so that the order is always the same.
+ */
+static int entrycmp(char* x, char* y) {
+    uint16_t xl = keylen(x);
+    uint16_t yl = keylen(y);
 
-        struct stat newst;
-        if (fstat(dfd, &newst) < 0) {
-            close(dfd);
-            return -1;
-        }
-        add_file_hash(&newst);
+    int c = memcmp(x + 2, y + 2, (xl < yl) ? xl : yl);
+    if (c) {
+        return c;
+    }
+    if (xl != yl) {
+        return (xl < yl) ? -1 : 1;
+    }
+    return strcmp(x + 2 + xl, y + 2 + yl);
+}
 
-        // copy the file
-        char cbuf[4096] = {0};
-        while (1) {
-            ssize_t r, w;
-            r = read(sfd, cbuf, 4096);
-            if (!r) {
-                break;
-            }
+/*
+ * Returns the extension of a name, or "" if it has none.
+ */
+static const char* extension(const char* name) {
+    const char* dot = strrchr(name, '.');
+    return (dot && dot != name) ? dot + 1 : "";
+}
 
-            if (r < 0) {
-                s = -1;
-                break;
-            }
+/*
+ * Compares two entries for the given sort mode. Directories always come
+ * first, and entries which are otherwise equal are ordered by name, so no two
+ * entries ever compare equal. Info is only needed for modes which use it.
+ */
+static int sortcmp(enum sortmode mode, char* x, const struct entryinfo* xi, char* y, const struct entryinfo* yi) {
+    // the first byte of a key says whether it's a directory
+    bool xdir = x[2] == 0;
+    bool ydir = y[2] == 0;
 
-            w = write(dfd, cbuf, r);
-            if (w < r) {
-                s = -1;
-                break;
+    if (xdir != ydir) {
+        return xdir ? -1 : 1;
+    }
+
+    switch (mode) {
+        case SORT_SIZE:
+            // the size of a directory says little about what's in it
+            if (!xdir && xi->size != yi->size) {
+                return (xi->size > yi->size) ? -1 : 1;
             }
-        }
+            break;
+        case SORT_TIME:
+            if (xi->mtime != yi->mtime) {
+                return (xi->mtime > yi->mtime) ? -1 : 1;
+            }
+            break;
+        case SORT_EXT:
+            if (!xdir) {
+                const char* xe = extension(entryname(x));
+                const char* ye = extension(entryname(y));
+                for (; *xe && toupper((unsigned char)*xe) == toupper((unsigned char)*ye); xe++, ye++);
+                if (toupper((unsigned char)*xe) != toupper((unsigned char)*ye)) {
+                    return toupper((unsigned char)*xe) - toupper((unsigned char)*ye);
+                }
+            }
+            break;
+        default:
+            break;
+    }
 
-        if (close(dfd) < 0) {
-            return -1;
-        }
-        close(sfd);
+    return entrycmp(x, y);
+}
 
-        if (!S_ISREG(srcstat.st_mode)) {
-            return s;
-        }
+// the list which is being sorted by this thread
+static _Thread_local char* sortnames;
+static _Thread_local const struct entryinfo* sortinfo;
+static _Thread_local enum sortmode sortby;
 
-        goto preserve;
+/*
+ * Comparison function for list elements for qsort. sortnames, sortinfo and
+ * sortby must be set for the list being sorted.
+ */
+static int elemcmp(const void* a, const void* b) {
+    const struct listelem* x = a;
+    const struct listelem* y = b;
+
+    if (sortby == SORT_NAME) {
+        return entrycmp(sortnames + x->name, sortnames + y->name);
     }
+    return sortcmp(sortby, sortnames + x->name, sortinfo ? &sortinfo[x->id] : NULL,
+            sortnames + y->name, sortinfo ? &sortinfo[y->id] : NULL);
+}
 
-notreg:
-    {
-        // source is not a regular file (it's a symlink or special)
-        if (S_ISLNK(srcstat.st_mode)) {
-            char lbuf[PATH_MAX+1] = {0};
-            ssize_t ls = readlink(src, lbuf, PATH_MAX);
-            if (ls == -1) {
-                return -1;
-            }
-            lbuf[ls] = '\0';
+/*
+ * A piece of a parallel sort: either a run to sort in place, or two adjacent
+ * sorted runs to merge into dst.
+ */
+struct sortpart {
+    char* names;
+    const struct entryinfo* info;
+    enum sortmode mode;
+    struct listelem* src;
+    struct listelem* dst;
+    size_t n;
+    size_t m;
+};
 
-            int r = symlink(lbuf, dst);
-            if (r != 0) {
-                return -1;
-            }
+static void* sort_run(void* arg) {
+    struct sortpart* p = arg;
+    sortnames = p->names;
+    sortinfo = p->info;
+    sortby = p->mode;
+    if (p->n) {
+        qsort(p->src, p->n, sizeof(*p->src), elemcmp);
+    }
+    return NULL;
+}
 
-            // can't preserve stuff for symlinks
-            return 0;
-        } else if (S_ISBLK(srcstat.st_mode) || S_ISCHR(srcstat.st_mode)
-                || S_ISSOCK(srcstat.st_mode) || S_ISFIFO(srcstat.st_mode)) {
-            if (mknod(dst, srcstat.st_mode, srcstat.st_rdev) < 0) {
-                return -1;
-            }
+static void* sort_merge(void* arg) {
+    struct sortpart* p = arg;
+    struct listelem* a = p->src;
+    struct listelem* b = p->src + p->n;
+    struct listelem* aend = b;
+    struct listelem* bend = b + p->m;
+    struct listelem* d = p->dst;
+
+    sortnames = p->names;
+    sortinfo = p->info;
+    sortby = p->mode;
+    while (a < aend && b < bend) {
+        // take from the first run on ties, like a stable merge
+        if (elemcmp(b, a) < 0) {
+            *d++ = *b++;
         } else {
-            return -1;
+            *d++ = *a++;
         }
     }
+    memcpy(d, a, (aend - a) * sizeof(*a));
+    d += aend - a;
+    memcpy(d, b, (bend - b) * sizeof(*b));
+    return NULL;
+}
 
-preserve:
-    {
-        // preserve mode, owner, attributes, etc. here
-        struct timeval t[2];
-        t[1].tv_sec = t[0].tv_sec = srcstat.st_mtime;
-        t[1].tv_usec = t[0].tv_usec = 0;
-
-        // we will fail silently if any of these don't work
-        utimes(dst, t);
-        (void)chown(dst, srcstat.st_uid, srcstat.st_gid);
-        chmod(dst, srcstat.st_mode);
+/*
+ * Runs fn on each part, each on its own thread. Parts whose thread can't be
+ * started are run on this one.
+ */
+static void sort_parts(void* (*fn)(void*), struct sortpart* parts, size_t n) {
+    pthread_t threads[SORT_THREADS_MAX];
+    bool started[SORT_THREADS_MAX];
 
-        return s;
+    for (size_t i = 1; i < n; i++) {
+        started[i] = (0 == pthread_create(&threads[i], NULL, fn, &parts[i]));
+    }
+    fn(&parts[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            fn(&parts[i]);
+        }
     }
 }
 
 /*
- * Copies a file or directory. Returns 0 on success and -1 on failure.
+ * Sorts a list. Large lists are split into runs which are sorted on separate
+ * threads, then merged pairwise, also in parallel. Since sortcmp() never
+ * finds two entries equal, the result is the same as sorting it in one go.
  */
-static int cpfile(const char* src, const char* dst) {
-    int s = cpfile_inner(src, dst);
-    reset_file_table();
-    return s;
-}
+static void sortlist(struct listelem* list, size_t n, char* names, const struct entryinfo* info, enum sortmode mode) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct listelem* tmp = NULL;
 
-static struct deletedfile* newdeleted(bool mass) {
-    struct deletedfile* d = malloc(sizeof(struct deletedfile));
-    if (!d) {
-        return NULL;
+    if (n >= SORT_PARALLEL_MIN && cpus > 1) {
+        tmp = malloc(n * sizeof(*list));
+    }
+    if (!tmp) {
+        struct sortpart p = { names, info, mode, list, NULL, n, 0 };
+        sort_run(&p);
+        return;
     }
 
-    d->original = malloc(NAME_MAX);
-    if (!d->original) {
-        free(d);
-        return NULL;
+    size_t k = (cpus > SORT_THREADS_MAX) ? SORT_THREADS_MAX : (size_t)cpus;
+    size_t bounds[SORT_THREADS_MAX + 1];
+    struct sortpart parts[SORT_THREADS_MAX];
+
+    for (size_t i = 0; i <= k; i++) {
+        bounds[i] = n * i / k;
+    }
+    for (size_t i = 0; i < k; i++) {
+        parts[i] = (struct sortpart){ names, info, mode, list + bounds[i], NULL, bounds[i+1] - bounds[i], 0 };
     }
+    sort_parts(sort_run, parts, k);
+
+    struct listelem* src = list;
+    struct listelem* dst = tmp;
+    while (k > 1) {
+        size_t p = 0;
+        for (size_t i = 0; i < k; i += 2) {
+            size_t end = (i + 2 <= k) ? bounds[i+2] : bounds[i+1];
+            parts[p++] = (struct sortpart){
+                names, info, mode, src + bounds[i], dst + bounds[i],
+                bounds[i+1] - bounds[i], end - bounds[i+1],
+            };
+            bounds[p] = end;
+        }
+        sort_parts(sort_merge, parts, p);
 
-    d->id = del_id++;
-    d->mass = mass;
-    if (d->mass) {
-        d->massid = mdel_id;
+        struct listelem* t = src;
+        src = dst;
+        dst = t;
+        k = p;
     }
-    d->prev = NULL;
 
-    return d;
+    if (src != list) {
+        memcpy(list, src, n * sizeof(*list));
+    }
+    free(tmp);
 }
 
-static struct deletedfile* freedeleted(struct deletedfile* f) {
-    struct deletedfile* d = f->prev;
-    free(f->original);
-    free(f);
-    return d;
+/*
+ * Makes sure a list has room for at least n elements, growing it
+ * geometrically.
+ */
+static void growlist(struct listelem** list, size_t* size, size_t n) {
+    if (n <= *size) {
+        return;
+    }
+
+    size_t newsize = *size ? *size : LIST_ALLOC_SIZE;
+    while (newsize < n) {
+        newsize *= 2;
+    }
+
+    struct listelem* l = realloc(*list, newsize * sizeof(**list));
+    if (!l) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    *list = l;
+    *size = newsize;
 }
 
-static int strnatcmp(const char *s1, const char *s2) {
-    for (;;) {
-        if (*s2 == '\0') {
-            return *s1 != '\0';
-        }
+/*
+ * Makes sure an info column has room for at least n entries.
+ */
+static void growinfo(struct entryinfo** info, size_t* size, size_t n) {
+    if (n <= *size) {
+        return;
+    }
 
-        if (*s1 == '\0') {
-            return 1;
-        }
+    size_t newsize = *size ? *size : LIST_ALLOC_SIZE;
+    while (newsize < n) {
+        newsize *= 2;
+    }
 
-        if (!(isdigit(*s1) && isdigit(*s2))) {
-            if (toupper(*s1) != toupper(*s2)) {
-                return toupper(*s1) - toupper(*s2);
-            }
-            ++s1;
-            ++s2;
-        } else {
-            char *lim1;
-            char *lim2;
-            unsigned long n1 = strtoul(s1, &lim1, 10);
-            unsigned long n2 = strtoul(s2, &lim2, 10);
-            if (n1 > n2) {
-                return 1;
-            } else if (n1 < n2) {
-                return -1;
-            }
-            s1 = lim1;
-            s2 = lim2;
-        }
+    struct entryinfo* i = realloc(*info, newsize * sizeof(**info));
+    if (!i) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
     }
+    *info = i;
+    *size = newsize;
 }
 
 /*
- * Comparison function for list elements for qsort.
+ * Makes sure there is room for at least n bytes of names.
  */
-static int elemcmp(const void* a, const void* b) {
-    const struct listelem* x = a;
-    const struct listelem* y = b;
+static void grownames(struct names* n, size_t len) {
+    if (len <= n->size) {
+        return;
+    }
 
-    if ((x->type == ELEM_DIR || x->type == ELEM_DIRLINK) &&
-            (y->type != ELEM_DIR && y->type != ELEM_DIRLINK)) {
-        return -1;
+    size_t newsize = n->size ? n->size : NAMES_ALLOC_SIZE;
+    while (newsize < len) {
+        newsize *= 2;
     }
 
-    if ((y->type == ELEM_DIR || y->type == ELEM_DIRLINK) &&
-            (x->type != ELEM_DIR && x->type != ELEM_DIRLINK)) {
-        return 1;
+    char* b = realloc(n->buf, newsize);
+    if (!b) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
     }
+    n->buf = b;
+    n->size = newsize;
+}
 
-    return strnatcmp(x->name, y->name);
+/*
+ * Appends the entry for a name, returning its offset.
+ */
+static uint32_t addname(struct names* n, bool dir, const char* name) {
+    char e[ENTRY_MAX];
+    size_t l = makeentry(e, dir, name);
+    grownames(n, n->len + l);
+    memcpy(n->buf + n->len, e, l);
+    n->len += l;
+    return (uint32_t)(n->len - l);
 }
 
 /*
@@ -696,16 +1543,77 @@ static void maketmpdir(void) {
         strncpy(tmpdir, "/tmp/cfmtmp", PATH_MAX);
     }
 #endif
-    if (mkdir(tmpdir, 0751)) {
-        if (errno == EEXIST) {
-            return;
-        } else {
-            tmpdir[0] = '\0';
+    struct stat st;
+    if (mkdir(tmpdir, 0751) && errno != EEXIST) {
+        tmpdir[0] = '\0';
+    } else if (0 == stat(tmpdir, &st)) {
+        tmpdev = st.st_dev;
+    }
+}
+
+/*
+ * Finds the trash directory on the same filesystem as path, so that moving it
+ * there is only a rename. If there isn't one yet, it's made as near to the top
+ * of the filesystem as cfm can write. Falls back to tmpdir, which means
+ * copying, if that can't be done.
+ */
+static const char* trashfor(const char* path) {
+    struct stat st, dst;
+    char dir[PATH_MAX+1];
+    char best[PATH_MAX+1] = "";
+
+    if (0 != lstat(path, &st) || st.st_dev == tmpdev) {
+        return tmpdir;
+    }
+    for (struct trash* t = trashes; t; t = t->next) {
+        if (t->dev == st.st_dev) {
+            return t->path;
+        }
+    }
+
+    // go up from the directory it's in for as long as that's the same
+    // filesystem, and take the highest one which can be written to
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash;
+    while ((slash = strrchr(dir, '/'))) {
+        *slash = '\0';
+        const char* d = dir[0] ? dir : "/";
+        if (0 != stat(d, &dst) || dst.st_dev != st.st_dev) {
+            break;
+        }
+        if (0 == access(d, W_OK | X_OK)) {
+            snprintf(best, sizeof(best), "%s", d);
         }
     }
+    if (!best[0] || strlen(best) > PATH_MAX - 32) {
+        return tmpdir;
+    }
+
+    struct trash* t = malloc(sizeof(*t));
+    if (!t) {
+        return tmpdir;
+    }
+    snprintf(t->path, sizeof(t->path), "%.*s/.cfmtrash-%ld", PATH_MAX - 32,
+            strcmp(best, "/") ? best : "", (long)getpid());
+    if (0 != mkdir(t->path, 0700)) {
+        free(t);
+        return tmpdir;
+    }
+    t->dev = st.st_dev;
+    t->next = trashes;
+    trashes = t;
+    return t->path;
 }
 
 static void rmtmp(void) {
+    while (trashes) {
+        struct trash* t = trashes;
+        if (0 != deldir(t->path)) {
+            perror("rmtmp: deldir");
+        }
+        trashes = t->next;
+        free(t);
+    }
     if (tmpdir[0]) {
         if (0 != deldir(tmpdir)) {
             perror("rmtmp: deldir");
@@ -763,173 +1671,4187 @@ static int backupterm(void) {
 }
 
 /*
- * Get the size of the terminal.
- * Returns 0 on success.
+ * Get the size of the terminal.
+ * Returns 0 on success.
+ */
+static int termsize(void) {
+    if (!interactive) return 0;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+
+    return 0;
+}
+
+/*
+ * Sets up the terminal for TUI.
+ * Return 0 on success.
+ */
+static int setupterm(void) {
+    if (!interactive) return 0;
+
+    setvbuf(stdout, NULL, _IOFBF, 0);
+
+    struct termios new_term = old_term;
+    new_term.c_oflag &= ~OPOST;
+    new_term.c_lflag &= ~(ECHO | ICANON);
+
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &new_term) < 0) {
+        perror("tcsetattr");
+        return 1;
+    }
+
+    printf(
+            "\033[?1049h" // use alternative screen buffer
+            "\033[?7l"    // disable line wrapping
+            "\033[?25l"   // hide cursor
+            "\033[2J"     // clear screen
+            "\033[2;%dr", // limit scrolling to our rows
+            rows-1);
+
+    return 0;
+}
+
+/*
+ * Resets the terminal to how it was before we ruined it.
+ */
+static void resetterm(void) {
+    if (!interactive) return;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term) < 0) {
+        perror("tcsetattr");
+        return;
+    }
+
+    printf(
+            "\033[?7h"    // enable line wrapping
+            "\033[?25h"   // unhide cursor
+            "\033[r"     // reset scroll region
+            "\033[?1049l" // restore main screen
+          );
+
+    fflush(stdout);
+}
+
+/*
+ * Creates a child process.
+ */
+static void execcmd(const char* path, const char* cmd, const char* arg) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return;
+    }
+
+    resetterm();
+
+    if (pid == 0) {
+        if (nofile.rlim_max) {
+            setrlimit(RLIMIT_NOFILE, &nofile);
+        }
+        if (chdir(path) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        execlp(cmd, cmd, arg, NULL);
+        _exit(EXIT_FAILURE);
+    } else {
+        int s;
+        do {
+            waitpid(pid, &s, WUNTRACED);
+        } while (!WIFEXITED(s) && !WIFSIGNALED(s));
+    }
+
+    setupterm();
+    fflush(stdout);
+}
+
+/*
+ * Writes all of a buffer, retrying short writes.
+ * Returns 0 on success, -1 on error.
+ */
+static int writeall(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/*
+ * Makes dfd share sfd's data, which on copy-on-write filesystems such as
+ * btrfs and XFS only has to copy metadata, however large the file is. dfd
+ * must be empty. Returns whether it worked, so that the data can be copied
+ * instead if it didn't.
+ */
+static bool reflink(int sfd, int dfd) {
+#if defined(__linux__) && defined(FICLONE)
+    return 0 == ioctl(dfd, FICLONE, sfd);
+#else
+    (void)sfd; (void)dfd;
+    return false;
+#endif
+}
+
+// the buffer copydata() falls back to, kept off the stack since the copying
+// threads may have small ones
+static _Thread_local char* copybuf;
+
+/*
+ * Frees this thread's copy buffer once it's done copying.
+ */
+static void copybuf_free(void) {
+    free(copybuf);
+    copybuf = NULL;
+}
+
+/*
+ * Copies len bytes, or the rest of the file if len is negative, from sfd into
+ * dfd at their current offsets. On Linux, the kernel is asked to do it with
+ * copy_file_range(2), which lets filesystems share or copy the data
+ * themselves, or failing that sendfile(2), which at least keeps it out of
+ * user space. Either stops being used as soon as it fails, and whatever is
+ * left is copied through a buffer.
+ * Returns 0 on success, -1 on error.
+ */
+static int copydata(int sfd, int dfd, off_t len) {
+    off_t left = len;
+#define COPY_WANT(max) ((left < 0 || left > (off_t)(max)) ? (size_t)(max) : (size_t)left)
+
+#ifdef __linux__
+    bool kernel = true;
+# ifdef SYS_copy_file_range
+    off_t copied = 0;
+    while (left) {
+        if (cancelled()) {
+            return -1;
+        }
+        long n = syscall(SYS_copy_file_range, sfd, NULL, dfd, NULL, COPY_WANT(COPY_CHUNK), 0);
+        if (n > 0) {
+            copied += n;
+            atomic_fetch_add(&copystats.bytes, n);
+            left -= (left > 0) ? n : 0;
+            continue;
+        }
+        if (n == 0 && copied) {
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // nothing at all means some files (like those in /proc) which claim
+        // to be empty, so they're read the usual way
+        if (n == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                || errno == EOPNOTSUPP || errno == EBADF || errno == ETXTBSY) {
+            break;
+        }
+        return -1;
+    }
+    kernel = copied == 0;
+# endif
+    while (kernel && left) {
+        if (cancelled()) {
+            return -1;
+        }
+        ssize_t n = sendfile(dfd, sfd, NULL, COPY_WANT(COPY_CHUNK));
+        if (n > 0) {
+            atomic_fetch_add(&copystats.bytes, n);
+            left -= (left > 0) ? n : 0;
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            break;
+        }
+        return -1;
+    }
+#endif
+
+    if (!copybuf && !(copybuf = malloc(COPY_BUF_SIZE))) {
+        return -1;
+    }
+    char* buf = copybuf;
+    while (left) {
+        if (cancelled()) {
+            return -1;
+        }
+        ssize_t r = read(sfd, buf, COPY_WANT(COPY_BUF_SIZE));
+        if (!r) {
+            return 0;
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (writeall(dfd, buf, r) < 0) {
+            return -1;
+        }
+        atomic_fetch_add(&copystats.bytes, r);
+        left -= (left > 0) ? r : 0;
+    }
+    return 0;
+#undef COPY_WANT
+}
+
+/*
+ * Copies a file which has holes in it, only copying the parts which hold data
+ * and leaving holes in dfd for the rest, so that it takes up no more space
+ * than sfd. Both must be at offset 0, and size is sfd's size.
+ * Returns the number of bytes skipped, or -1 on error. If the filesystem can't
+ * tell where the holes are, the whole file is copied and 0 is returned.
+ */
+static off_t copysparse(int sfd, int dfd, off_t size) {
+#ifdef SEEK_HOLE
+    off_t pos = 0;
+    off_t skipped = 0;
+    while (pos < size) {
+        off_t data = lseek(sfd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                // the rest is a hole
+                skipped += size - pos;
+                break;
+            }
+            if (pos == 0 && (errno == EINVAL || errno == ENOTSUP)) {
+                break;
+            }
+            return -1;
+        }
+        off_t hole = lseek(sfd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+        skipped += data - pos;
+        if (lseek(sfd, data, SEEK_SET) < 0 || lseek(dfd, data, SEEK_SET) < 0
+                || copydata(sfd, dfd, hole - data) < 0) {
+            return -1;
+        }
+        pos = hole;
+    }
+    if (pos > 0 || skipped > 0) {
+        // a hole at the end has to be made by setting the size
+        return (ftruncate(dfd, size) < 0) ? -1 : skipped;
+    }
+    lseek(sfd, 0, SEEK_SET);
+#else
+    (void)size;
+#endif
+    return (copydata(sfd, dfd, -1) < 0) ? -1 : 0;
+}
+
+#if IO_URING
+/*
+ * A minimal io_uring, set up by hand with the raw system calls so as not to
+ * need liburing. Each copy thread gets its own, since a ring's submission
+ * queue may only be filled from one thread.
+ */
+struct uring {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned* sqhead;
+    _Atomic unsigned* sqtail;
+    unsigned* sqmask;
+    unsigned* sqarray;
+    struct io_uring_sqe* sqes;
+    _Atomic unsigned* cqhead;
+    _Atomic unsigned* cqtail;
+    unsigned* cqmask;
+    struct io_uring_cqe* cqes;
+    void* sqmap;
+    size_t sqmaplen;
+    void* cqmap;
+    size_t cqmaplen;
+    size_t sqeslen;
+    unsigned queued; // filled in but not yet submitted
+};
+
+// set once io_uring turns out not to be usable, so it isn't tried again
+static atomic_bool uring_broken;
+
+static void uring_free(struct uring* r) {
+    if (!r) {
+        return;
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqeslen);
+    }
+    if (r->cqmap && r->cqmap != r->sqmap) {
+        munmap(r->cqmap, r->cqmaplen);
+    }
+    if (r->sqmap) {
+        munmap(r->sqmap, r->sqmaplen);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r);
+}
+
+/*
+ * Checks that the kernel can do everything a copy needs through the ring.
+ */
+static bool uring_probe(struct uring* r) {
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* p = calloc(1, size);
+    if (!p) {
+        return false;
+    }
+    bool ok = 0 == syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, IORING_OP_LAST);
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(*ops); i++) {
+        ok = ops[i] <= p->last_op && (p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(p);
+    return ok;
+}
+
+/*
+ * Sets up a ring. Returns NULL if io_uring can't be used.
+ */
+static struct uring* uring_new(unsigned entries) {
+    if (atomic_load(&uring_broken)) {
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    struct uring* r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (r->fd < 0 || !uring_probe(r)) {
+        atomic_store(&uring_broken, true);
+        uring_free(r);
+        return NULL;
+    }
+    fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+
+    r->entries = p.sq_entries;
+    r->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqmaplen > r->sqmaplen) {
+            r->sqmaplen = r->cqmaplen;
+        }
+        r->cqmaplen = r->sqmaplen;
+    }
+    r->sqmap = mmap(NULL, r->sqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqmap == MAP_FAILED) {
+        r->sqmap = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqmap = r->sqmap;
+    } else {
+        r->cqmap = mmap(NULL, r->cqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqmap == MAP_FAILED) {
+            r->cqmap = NULL;
+            uring_free(r);
+            return NULL;
+        }
+    }
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return NULL;
+    }
+
+    char* sq = r->sqmap;
+    char* cq = r->cqmap;
+    r->sqhead = (_Atomic unsigned*)(sq + p.sq_off.head);
+    r->sqtail = (_Atomic unsigned*)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq + p.sq_off.array);
+    r->cqhead = (_Atomic unsigned*)(cq + p.cq_off.head);
+    r->cqtail = (_Atomic unsigned*)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+/*
+ * Fills in the next submission and returns it, for any fields not covered
+ * here. There must be room for it, which callers make sure of by never
+ * queueing more than the ring's entries at once.
+ */
+static struct io_uring_sqe* uring_queue(struct uring* r, unsigned char op, int fd, const void* addr, unsigned len, uint64_t off, unsigned char flags, uint64_t data) {
+    unsigned tail = atomic_load_explicit(r->sqtail, memory_order_relaxed) + r->queued;
+    unsigned i = tail & *r->sqmask;
+    struct io_uring_sqe* sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+    r->sqarray[i] = i;
+    r->queued++;
+    return sqe;
+}
+
+/*
+ * Submits everything queued and waits for n completions, handing each to fn.
+ * Returns false if the kernel refused, in which case nothing was submitted.
+ */
+static bool uring_run(struct uring* r, unsigned n, void (*fn)(void* ctx, uint64_t data, int res), void* ctx) {
+    unsigned tail = atomic_load_explicit(r->sqtail, memory_order_relaxed);
+    atomic_store_explicit(r->sqtail, tail + r->queued, memory_order_release);
+    unsigned total = r->queued;
+    unsigned submit = total;
+    r->queued = 0;
+
+    while (n) {
+        long e = syscall(SYS_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (e < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            if (submit == total) {
+                // take the submissions back, since they'll never be seen
+                atomic_store_explicit(r->sqtail, tail, memory_order_release);
+                return false;
+            }
+            // some of them are already using our buffers
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        submit -= ((unsigned)e < submit) ? (unsigned)e : submit;
+
+        unsigned head = atomic_load_explicit(r->cqhead, memory_order_relaxed);
+        unsigned end = atomic_load_explicit(r->cqtail, memory_order_acquire);
+        for (; head != end && n; head++, n--) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cqmask];
+            fn(ctx, cqe->user_data, cqe->res);
+        }
+        atomic_store_explicit(r->cqhead, head, memory_order_release);
+    }
+    return true;
+}
+#endif /* IO_URING */
+
+/*
+ * Copies of directories are spread over a pool of COPY_THREADS threads. Each
+ * directory is read by one task, which creates its subdirectories right away
+ * and queues them to be read, and queues a task for each regular file in it.
+ * Directories are always created before anything is copied into them, and a
+ * directory's attributes are only set once everything in it is done, since
+ * copying into it would change its mtime again.
+ *
+ * Everything below the top is reached relative to descriptors for the
+ * directories it's in, rather than by path, which saves building paths and
+ * having the kernel look them up for every file, and lets trees deeper than
+ * PATH_MAX be copied. A directory's descriptors are opened when it's read and
+ * kept until everything in it is done.
+ */
+struct cpjob {
+    struct pool pool; // first, so that tasks can get at the job
+    atomic_int status; // -1 once anything has failed
+    pthread_mutex_t lock; // for everything below
+    pthread_cond_t linked; // signalled when a file with several links is copied
+    struct inoset made; // what's been created, so that a copy into itself stops
+    struct inoset links; // files with several links, valued by where they were copied to in paths
+    char* paths; // each a LINK_ state followed by the path
+    size_t pathslen;
+    size_t pathssize;
+};
+
+struct cpnode {
+    struct cpnode* parent;
+    atomic_long pending; // for a directory, its children still being copied, plus one until it's read
+    struct stat st; // of the source
+    int sfd; // for a directory, it and its copy once it's being read, else -1
+    int dfd;
+    char* dst; // name in the parent's copy, or the whole path at the top
+    char src[];
+};
+
+// the directories the source and target of n are in
+#define CP_SDIR(n) ((n)->parent ? (n)->parent->sfd : AT_FDCWD)
+#define CP_DDIR(n) ((n)->parent ? (n)->parent->dfd : AT_FDCWD)
+
+static struct cpnode* cp_newnode(struct cpnode* parent, const char* src, const char* dst, const struct stat* st) {
+    size_t sl = strlen(src) + 1;
+    size_t dl = strlen(dst) + 1;
+    struct cpnode* n = malloc(sizeof(*n) + sl + dl);
+    if (!n) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    n->parent = parent;
+    atomic_init(&n->pending, 1);
+    n->st = *st;
+    n->sfd = n->dfd = -1;
+    memcpy(n->src, src, sl);
+    n->dst = n->src + sl;
+    memcpy(n->dst, dst, dl);
+    if (parent) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    return n;
+}
+
+/*
+ * Returns whether a source is something the copy created, which it mustn't
+ * copy again.
+ */
+static bool cp_ismade(struct cpjob* j, const struct stat* st) {
+    pthread_mutex_lock(&j->lock);
+    bool made = inoset_find(&j->made, st->st_dev, st->st_ino) != NULL;
+    pthread_mutex_unlock(&j->lock);
+    return made;
+}
+
+static void cp_made(struct cpjob* j, const struct stat* st) {
+    bool added;
+    pthread_mutex_lock(&j->lock);
+    inoset_add(&j->made, st->st_dev, st->st_ino, &added);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Writes the path of name in parent's copy, relative to the top of the copy,
+ * at the end of buf. Returns where it starts, or NULL if it's too long.
+ */
+static char* cp_relpath(const struct cpnode* parent, const char* name, char* buf, size_t size) {
+    char* p = buf + size;
+    *--p = '\0';
+    for (;;) {
+        size_t len = strlen(name);
+        if (len + 1 >= (size_t)(p - buf)) {
+            return NULL;
+        }
+        p -= len;
+        memcpy(p, name, len);
+        if (!parent->parent) {
+            return p;
+        }
+        *--p = '/';
+        name = parent->dst;
+        parent = parent->parent;
+    }
+}
+
+// the directory at the top of the copy
+static int cp_topdir(const struct cpnode* n) {
+    while (n->parent) {
+        n = n->parent;
+    }
+    return n->dfd;
+}
+
+/*
+ * Gives a copy the mode, owner and times of its source. The copy is name in
+ * the directory fd, or fd itself if name is NULL. Fails silently.
+ */
+static void cp_preserve(int fd, const char* name, const struct stat* st) {
+    struct timespec t[2];
+    t[1].tv_sec = t[0].tv_sec = st->st_mtime;
+    t[1].tv_nsec = t[0].tv_nsec = 0;
+
+    if (name) {
+        utimensat(fd, name, t, 0);
+        (void)fchownat(fd, name, st->st_uid, st->st_gid, 0);
+        fchmodat(fd, name, st->st_mode & 07777, 0);
+    } else {
+        futimens(fd, t);
+        (void)fchown(fd, st->st_uid, st->st_gid);
+        fchmod(fd, st->st_mode & 07777);
+    }
+}
+
+/*
+ * Marks one more part of a file or directory as copied. Once all of a
+ * directory is, its attributes are set, and so on up.
+ */
+static void cp_done(struct cpnode* n) {
+    while (n && atomic_fetch_sub(&n->pending, 1) == 1) {
+        struct cpnode* parent = n->parent;
+        if (n->dfd >= 0) {
+            cp_preserve(n->dfd, NULL, &n->st);
+            close(n->dfd);
+        }
+        if (n->sfd >= 0) {
+            close(n->sfd);
+        }
+        free(n);
+        n = parent;
+    }
+}
+
+/*
+ * Copies the regular file src in the directory sdir to dst in ddir.
+ * Returns 0 on success, -1 on error.
+ */
+static int cp_regular(struct cpjob* j, int sdir, const char* src, int ddir, const char* dst, const struct stat* st) {
+    int s = 0;
+    int sfd = openat(sdir, src, O_RDONLY | O_CLOEXEC);
+    if (sfd == -1) {
+        return -1;
+    }
+
+    int dfd = openat(ddir, dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+    if (dfd == -1) {
+        close(sfd);
+        return -1;
+    }
+    // only the top of the copy isn't in a directory of it
+    if (ddir == AT_FDCWD) {
+        atomic_store(&copystats.top, true);
+    }
+
+    struct stat newst;
+    if (fstat(dfd, &newst) < 0) {
+        close(dfd);
+        close(sfd);
+        return -1;
+    }
+    cp_made(j, &newst);
+
+    // copy the file, or only its metadata if the filesystem can share the
+    // data between them. Files which take up less space than their size
+    // have holes, which are kept. The bytes copied are counted as they go.
+    atomic_fetch_add(&copystats.files, 1);
+    if (reflink(sfd, dfd)) {
+        atomic_fetch_add(&copystats.bytes, st->st_size);
+    } else {
+        off_t skipped;
+        if ((off_t)st->st_blocks * 512 < st->st_size) {
+            skipped = copysparse(sfd, dfd, st->st_size);
+        } else {
+            skipped = copydata(sfd, dfd, -1);
+        }
+        if (skipped < 0) {
+            s = -1;
+        } else {
+            atomic_fetch_add(&copystats.bytes, skipped);
+            atomic_fetch_add(&copystats.skipped, skipped);
+        }
+    }
+
+    close(sfd);
+    cp_preserve(dfd, NULL, st);
+    if (close(dfd) < 0) {
+        return -1;
+    }
+    return s;
+}
+
+/*
+ * Hard links below the top of a copy are kept. The first time a file with
+ * several links is found, where it's copied to is remembered, and its other
+ * links are linked to the copy instead of being copied again, waiting for it
+ * if it's still being copied on another thread.
+ */
+enum { LINK_COPYING, LINK_DONE, LINK_FAILED };
+
+/*
+ * Copies a regular file with several links, src in parent's source, to dst
+ * in its copy. Returns 0 on success, -1 on error.
+ */
+static int cp_linked(struct cpjob* j, struct cpnode* parent, const char* src, const char* dst, const struct stat* st) {
+    char buf[PATH_MAX];
+    char* path = cp_relpath(parent, dst, buf, sizeof(buf));
+    size_t len = path ? strlen(path) + 2 : 0;
+    size_t off;
+    bool added = false;
+
+    pthread_mutex_lock(&j->lock);
+    struct inoslot* slot = inoset_find(&j->links, st->st_dev, st->st_ino);
+    if (slot) {
+        off = slot->val;
+        while (j->paths[off] == LINK_COPYING) {
+            pthread_cond_wait(&j->linked, &j->lock);
+        }
+        if (j->paths[off] == LINK_DONE) {
+            strcpy(buf, j->paths + off + 1);
+            pthread_mutex_unlock(&j->lock);
+            if (0 == linkat(cp_topdir(parent), buf, parent->dfd, dst, 0)) {
+                atomic_fetch_add(&copystats.files, 1);
+                atomic_fetch_add(&copystats.links, 1);
+                return 0;
+            }
+            return cp_regular(j, parent->sfd, src, parent->dfd, dst, st);
+        }
+    } else if (path && j->pathslen + len <= UINT32_MAX) {
+        if (j->pathslen + len > j->pathssize) {
+            size_t size = j->pathssize ? j->pathssize : NAMES_ALLOC_SIZE;
+            while (size < j->pathslen + len) {
+                size *= 2;
+            }
+            char* paths = realloc(j->paths, size);
+            if (!paths) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            j->paths = paths;
+            j->pathssize = size;
+        }
+        off = j->pathslen;
+        j->paths[off] = LINK_COPYING;
+        memcpy(j->paths + off + 1, path, len - 1);
+        j->pathslen += len;
+        inoset_add(&j->links, st->st_dev, st->st_ino, &added)->val = off;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    int s = cp_regular(j, parent->sfd, src, parent->dfd, dst, st);
+    if (added) {
+        pthread_mutex_lock(&j->lock);
+        j->paths[off] = (s < 0) ? LINK_FAILED : LINK_DONE;
+        pthread_cond_broadcast(&j->linked);
+        pthread_mutex_unlock(&j->lock);
+    }
+    return s;
+}
+
+/*
+ * Makes a device, FIFO or socket node relative to a directory. Before macOS
+ * 13 there's no mknodat(2), so the path is got from the directory there.
+ */
+static int mknodin(int dfd, const char* name, mode_t mode, dev_t dev) {
+#if defined(__APPLE__) && defined(F_GETPATH)
+    char path[PATH_MAX];
+    if (dfd != AT_FDCWD) {
+        if (fcntl(dfd, F_GETPATH, path) < 0) {
+            return -1;
+        }
+        size_t len = strlen(path);
+        if ((size_t)snprintf(path + len, sizeof(path) - len, "/%s", name) >= sizeof(path) - len) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        name = path;
+    }
+    return mknod(name, mode, dev);
+#else
+    return mknodat(dfd, name, mode, dev);
+#endif
+}
+
+/*
+ * Copies something which is neither a directory nor a regular file, from src
+ * in the directory sdir to dst in ddir.
+ * Returns 0 on success, -1 on error.
+ */
+static int cp_special(int sdir, const char* src, int ddir, const char* dst, const struct stat* st) {
+    if (S_ISLNK(st->st_mode)) {
+        char lbuf[PATH_MAX+1] = {0};
+        ssize_t ls = readlinkat(sdir, src, lbuf, PATH_MAX);
+        if (ls == -1) {
+            return -1;
+        }
+        lbuf[ls] = '\0';
+
+        // can't preserve stuff for symlinks
+        return symlinkat(lbuf, ddir, dst);
+    }
+
+    if (S_ISBLK(st->st_mode) || S_ISCHR(st->st_mode)
+            || S_ISSOCK(st->st_mode) || S_ISFIFO(st->st_mode)) {
+        if (mknodin(ddir, dst, st->st_mode, st->st_rdev) < 0) {
+            return -1;
+        }
+        cp_preserve(ddir, dst, st);
+        return 0;
+    }
+
+    return -1;
+}
+
+#if IO_URING
+/*
+ * Small regular files are copied in batches through io_uring rather than by
+ * their own tasks, so that opening, reading, writing and closing a whole
+ * batch takes a few system calls instead of several per file. The source is
+ * closed as soon as it's read and the target as soon as it's written, by
+ * requests linked to those. Anything which goes wrong with a file in a
+ * batch is cleaned up and the file copied again the usual way, which
+ * reports the error if there is one.
+ */
+
+// regular files up to this size are copied in batches
+#define URING_FILE_MAX (64 * 1024)
+
+// most files and bytes in one batch, which bounds the requests in flight
+#define URING_BATCH_FILES 32
+#define URING_BATCH_BYTES (1024 * 1024)
+
+struct cpbatch {
+    struct cpnode* files[URING_BATCH_FILES];
+    size_t n;
+    size_t bytes;
+};
+
+// what each request in a batch was for, in the low bits of its user data
+enum {
+    CP_OPENSRC,
+    CP_OPENDST,
+    CP_READ,
+    CP_WRITE,
+    CP_CLOSESRC,
+    CP_CLOSEDST,
+    CP_KINDS = 8,
+};
+
+// results of the requests for one file in a batch
+struct cpslot {
+    int sfd;
+    int dfd;
+    int read;
+    int write;
+    int closesrc; // 1 until the close has been done
+    int closedst;
+};
+
+static _Thread_local struct uring* cpring;
+static _Thread_local bool cpringtried;
+
+static void cp_complete(void* ctx, uint64_t data, int res) {
+    struct cpslot* s = (struct cpslot*)ctx + data / CP_KINDS;
+    switch (data % CP_KINDS) {
+        case CP_OPENSRC: s->sfd = res; break;
+        case CP_OPENDST: s->dfd = res; break;
+        case CP_READ: s->read = res; break;
+        case CP_WRITE: s->write = res; break;
+        case CP_CLOSESRC: s->closesrc = res; break;
+        case CP_CLOSEDST: s->closedst = res; break;
+    }
+}
+
+/*
+ * Copies the files in a batch and empties it.
+ */
+static void cp_flush(struct cpjob* j, struct cpbatch* b) {
+    struct cpslot slots[URING_BATCH_FILES];
+    size_t offs[URING_BATCH_FILES];
+    char* buf = NULL;
+    bool ok = false;
+
+    if (!b->n) {
+        return;
+    }
+    if (!cpringtried) {
+        cpringtried = true;
+        cpring = uring_new(URING_BATCH_FILES * 2);
+    }
+    if (cpring) {
+        buf = malloc(b->bytes + b->n);
+    }
+
+    // each file gets a byte more than its size, so that one which has grown
+    // since it was stat()ed reads more than that and isn't cut short
+    for (size_t i = 0, off = 0; i < b->n; i++) {
+        slots[i] = (struct cpslot){ -1, -1, -1, -1, 1, 1 };
+        offs[i] = off;
+        off += b->files[i]->st.st_size + 1;
+    }
+
+    if (buf) {
+        // open both ends of every file
+        for (size_t i = 0; i < b->n; i++) {
+            struct cpnode* n = b->files[i];
+            struct io_uring_sqe* sqe;
+            sqe = uring_queue(cpring, IORING_OP_OPENAT, CP_SDIR(n), n->src, 0, 0, 0, i * CP_KINDS + CP_OPENSRC);
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe = uring_queue(cpring, IORING_OP_OPENAT, CP_DDIR(n), n->dst, n->st.st_mode & 07777, 0, 0, i * CP_KINDS + CP_OPENDST);
+            sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        }
+        ok = uring_run(cpring, b->n * 2, cp_complete, slots);
+    }
+
+    if (ok) {
+        // read each file and close it, even if the read fails
+        unsigned count = 0;
+        for (size_t i = 0; i < b->n; i++) {
+            struct cpslot* s = &slots[i];
+            if (s->sfd >= 0 && s->dfd >= 0) {
+                uring_queue(cpring, IORING_OP_READ, s->sfd, buf + offs[i], b->files[i]->st.st_size + 1, 0, IOSQE_IO_HARDLINK, i * CP_KINDS + CP_READ);
+                count++;
+            }
+            if (s->sfd >= 0) {
+                uring_queue(cpring, IORING_OP_CLOSE, s->sfd, NULL, 0, 0, 0, i * CP_KINDS + CP_CLOSESRC);
+                count++;
+            }
+            if (s->sfd < 0 && s->dfd >= 0) {
+                uring_queue(cpring, IORING_OP_CLOSE, s->dfd, NULL, 0, 0, 0, i * CP_KINDS + CP_CLOSEDST);
+                count++;
+            }
+        }
+        ok = uring_run(cpring, count, cp_complete, slots);
+    }
+
+    if (ok) {
+        // write out whatever was read in full, and close the targets. Files
+        // whose size has changed are copied again the usual way
+        unsigned count = 0;
+        for (size_t i = 0; i < b->n; i++) {
+            struct cpslot* s = &slots[i];
+            if (s->sfd < 0 || s->dfd < 0) {
+                continue;
+            }
+            if (s->read == b->files[i]->st.st_size) {
+                uring_queue(cpring, IORING_OP_WRITE, s->dfd, buf + offs[i], s->read, 0, IOSQE_IO_HARDLINK, i * CP_KINDS + CP_WRITE);
+                count++;
+            }
+            uring_queue(cpring, IORING_OP_CLOSE, s->dfd, NULL, 0, 0, 0, i * CP_KINDS + CP_CLOSEDST);
+            count++;
+        }
+        ok = uring_run(cpring, count, cp_complete, slots);
+    }
+
+    for (size_t i = 0; i < b->n; i++) {
+        struct cpslot* s = &slots[i];
+        struct cpnode* n = b->files[i];
+        // anything the ring didn't get to close is closed here
+        if (s->sfd >= 0 && s->closesrc > 0) {
+            close(s->sfd);
+        }
+        if (s->dfd >= 0 && s->closedst > 0) {
+            close(s->dfd);
+        }
+
+        if (ok && s->dfd >= 0 && s->write == n->st.st_size && s->closedst == 0) {
+            atomic_fetch_add(&copystats.files, 1);
+            atomic_fetch_add(&copystats.bytes, n->st.st_size);
+            cp_preserve(CP_DDIR(n), n->dst, &n->st);
+        } else {
+            // only remove the target if it was this which created it
+            if (s->dfd >= 0) {
+                unlinkat(CP_DDIR(n), n->dst, 0);
+            }
+            if (cp_regular(j, CP_SDIR(n), n->src, CP_DDIR(n), n->dst, &n->st) < 0) {
+                atomic_store(&j->status, -1);
+            }
+        }
+        cp_done(n);
+    }
+
+    free(buf);
+    b->n = 0;
+    b->bytes = 0;
+}
+
+/*
+ * Adds a file to a batch, copying the batch first if it's full.
+ */
+static void cp_batchadd(struct cpjob* j, struct cpbatch* b, struct cpnode* n) {
+    if (b->n == URING_BATCH_FILES || b->bytes + n->st.st_size > URING_BATCH_BYTES) {
+        cp_flush(j, b);
+    }
+    b->files[b->n++] = n;
+    b->bytes += n->st.st_size;
+}
+
+/*
+ * Frees this thread's ring once it's done copying.
+ */
+static void cp_ringfree(void) {
+    uring_free(cpring);
+    cpring = NULL;
+    cpringtried = false;
+}
+#endif /* IO_URING */
+
+struct cpbatch;
+static void cp_entry(struct cpjob* j, size_t id, struct cpnode* parent, const char* src, const char* dst, struct cpbatch* batch);
+
+static void cp_filetask(struct pool* p, size_t UNUSED(id), void* arg) {
+    struct cpnode* n = arg;
+    if (cp_regular((struct cpjob*)p, CP_SDIR(n), n->src, CP_DDIR(n), n->dst, &n->st) < 0) {
+        atomic_store(&((struct cpjob*)p)->status, -1);
+    }
+    cp_done(n);
+}
+
+static void cp_dirtask(struct pool* p, size_t id, void* arg) {
+    struct cpjob* j = (struct cpjob*)p;
+    struct cpnode* n = arg;
+    struct liststats stats = {0};
+    struct dirreader r;
+    const char* name;
+    unsigned char dtype;
+    struct cpbatch* batch = NULL;
+#if IO_URING
+    struct cpbatch b = { .n = 0 };
+    batch = &b;
+#endif
+
+    // the directories are opened here rather than when they're found, so
+    // that only those being copied hold descriptors, not those queued
+    n->sfd = openat(CP_SDIR(n), n->src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    n->dfd = openat(CP_DDIR(n), n->dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (n->sfd < 0 || n->dfd < 0 || 0 != dr_openat(&r, n->sfd, ".", 0, &stats)) {
+        atomic_store(&j->status, -1);
+        cp_done(n);
+        return;
+    }
+    while (dr_next(&r, &name, &dtype)) {
+        if (0 != strcmp(name, ".") && 0 != strcmp(name, "..")) {
+            cp_entry(j, id, n, name, name, batch);
+        }
+    }
+    dr_close(&r);
+#if IO_URING
+    cp_flush(j, batch);
+#endif
+    cp_done(n);
+}
+
+/*
+ * Copies one entry of a directory being copied, src in parent's source and dst
+ * in its copy, or the top of the copy if parent is NULL, in which case they
+ * are paths. Directories are created here and queued to be read, and regular
+ * files are queued to be copied, or added to batch if they're small and there
+ * is one.
+ */
+static void cp_entry(struct cpjob* j, size_t id, struct cpnode* parent, const char* src, const char* dst, struct cpbatch* batch) {
+    int sdir = parent ? parent->sfd : AT_FDCWD;
+    int ddir = parent ? parent->dfd : AT_FDCWD;
+    struct stat srcstat, dststat;
+    if (cancelled() || fstatat(sdir, src, &srcstat, AT_SYMLINK_NOFOLLOW) < 0) {
+        // couldn't stat source
+        atomic_store(&j->status, -1);
+        return;
+    }
+
+    // if we already created this file we don't want to create it again
+    if (cp_ismade(j, &srcstat)) {
+        return;
+    }
+
+    // these are copied right away, so that their other links can find them
+    if (parent && S_ISREG(srcstat.st_mode) && srcstat.st_nlink > 1) {
+        if (cp_linked(j, parent, src, dst, &srcstat) < 0) {
+            atomic_store(&j->status, -1);
+        }
+        return;
+    }
+
+#if IO_URING
+    if (batch && !atomic_load(&uring_broken) && S_ISREG(srcstat.st_mode)
+            && srcstat.st_size <= URING_FILE_MAX) {
+        // creating the target with O_EXCL makes sure it doesn't exist yet
+        cp_batchadd(j, batch, cp_newnode(parent, src, dst, &srcstat));
+        return;
+    }
+#else
+    (void)batch;
+#endif
+
+    // the target mustn't exist, and certainly mustn't be the source
+    if (fstatat(ddir, dst, &dststat, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+        atomic_store(&j->status, -1);
+        return;
+    }
+
+    // the top is only ours to remove once it's been created here, since
+    // something else could have made it since the check
+    if (S_ISDIR(srcstat.st_mode)) {
+        // make sure we can write into it until its mode is set at the end
+        if (mkdirat(ddir, dst, (srcstat.st_mode & 07777) | S_IRWXU) < 0) {
+            atomic_store(&j->status, -1);
+            return;
+        }
+        if (!parent) {
+            atomic_store(&copystats.top, true);
+        }
+        if (fstatat(ddir, dst, &dststat, AT_SYMLINK_NOFOLLOW) < 0) {
+            atomic_store(&j->status, -1);
+            return;
+        }
+        cp_made(j, &dststat);
+        pool_push(&j->pool, id, cp_dirtask, cp_newnode(parent, src, dst, &srcstat));
+    } else if (S_ISREG(srcstat.st_mode)) {
+        pool_push(&j->pool, id, cp_filetask, cp_newnode(parent, src, dst, &srcstat));
+    } else if (cp_special(sdir, src, ddir, dst, &srcstat) < 0) {
+        atomic_store(&j->status, -1);
+    } else if (!parent) {
+        atomic_store(&copystats.top, true);
+    }
+}
+
+static void* cp_thread(void* arg) {
+    pool_thread(arg);
+#if IO_URING
+    cp_ringfree();
+#endif
+    copybuf_free();
+    return NULL;
+}
+
+/*
+ * Copies a file or directory. Returns 0 on success and -1 on failure.
+ */
+static int cpfile(const char* src, const char* dst) {
+    struct cpjob j;
+    pthread_t threads[POOL_THREADS_MAX];
+    struct poolworker workers[POOL_THREADS_MAX];
+    size_t started = 0;
+
+    atomic_store(&copystats.files, 0);
+    atomic_store(&copystats.bytes, 0);
+    atomic_store(&copystats.skipped, 0);
+    atomic_store(&copystats.links, 0);
+    atomic_store(&copystats.top, false);
+    atomic_init(&j.status, 0);
+    pthread_mutex_init(&j.lock, NULL);
+    pthread_cond_init(&j.linked, NULL);
+    j.made = j.links = (struct inoset){0};
+    j.paths = NULL;
+    j.pathslen = j.pathssize = 0;
+    pool_init(&j.pool, COPY_THREADS);
+
+    cp_entry(&j, 0, NULL, src, dst, NULL);
+
+    // only a directory is worth starting the other threads for
+    struct stat st;
+    if (atomic_load(&j.pool.tasks) && 0 == lstat(src, &st) && S_ISDIR(st.st_mode)) {
+        for (size_t i = 1; i < j.pool.nqueues; i++) {
+            workers[started] = (struct poolworker){ &j.pool, i };
+            if (0 != pthread_create(&threads[started], NULL, cp_thread, &workers[started])) {
+                break;
+            }
+            started++;
+        }
+    }
+    cp_thread(&(struct poolworker){ &j.pool, 0 });
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pool_destroy(&j.pool);
+    pthread_mutex_destroy(&j.lock);
+    pthread_cond_destroy(&j.linked);
+    inoset_free(&j.made);
+    inoset_free(&j.links);
+    free(j.paths);
+    return atomic_load(&j.status);
+}
+
+/*
+ * Works out the elemtype of a directory entry, trusting d_type where possible
+ * and only calling fstatat when the type is unknown, for symlinks, and for
+ * regular files (which need the exec bit).
+ * If lazy is set, regular files are not stat'd and are typed as ELEM_FILE
+ * until resolve() is called on them.
+ * If info is given, every entry is stat'd and its size and time are stored
+ * there.
+ * Returns 0 on success, 1 if the type is pending, or -1 if the entry could not
+ * be stat'd.
+ */
+static int classify(int dfd, const char* name, unsigned char dtype, enum elemtype* type, bool lazy, struct entryinfo* info, struct liststats* ls) {
+    struct stat st;
+
+    // the size and time have to come from a stat, so d_type is no help
+    switch (info ? 0 : dtype) {
+#ifdef DT_DIR
+        case DT_DIR:
+            *type = ELEM_DIR;
+            return 0;
+        case DT_LNK:
+            ls->stats++;
+            ls->links++;
+            if (0 == fstatat(dfd, name, &st, 0) && S_ISDIR(st.st_mode)) {
+                *type = ELEM_DIRLINK;
+            } else {
+                *type = ELEM_LINK;
+            }
+            return 0;
+        case DT_REG:
+            if (lazy) {
+                *type = ELEM_FILE;
+                return 1;
+            }
+            ls->stats++;
+            if (0 != fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+                return -1;
+            }
+            *type = (st.st_mode & S_IXUSR) ? ELEM_EXEC : ELEM_FILE;
+            return 0;
+        case DT_FIFO:
+        case DT_CHR:
+        case DT_BLK:
+        case DT_SOCK:
+            *type = ELEM_FILE;
+            return 0;
+#endif
+        default:
+            break;
+    }
+
+    ls->stats++;
+    if (0 != fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        return -1;
+    }
+
+    if (info) {
+        info->size = st.st_size;
+        info->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        *type = ELEM_DIR;
+    } else if (S_ISLNK(st.st_mode)) {
+        ls->stats++;
+        ls->links++;
+        if (0 == fstatat(dfd, name, &st, 0) && S_ISDIR(st.st_mode)) {
+            *type = ELEM_DIRLINK;
+        } else {
+            *type = ELEM_LINK;
+        }
+    } else if (st.st_mode & S_IXUSR) {
+        *type = ELEM_EXEC;
+    } else {
+        *type = ELEM_FILE;
+    }
+
+    return 0;
+}
+
+/*
+ * Identifies the contents of a directory listing. The times are those of the
+ * directory from before it was read, so any change made while or after it was
+ * read will not match.
+ */
+struct listkey {
+    bool valid;
+    bool hidden;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+/*
+ * Cache of sorted listings for directories which aren't being shown, so that
+ * going back to one only takes a stat if it hasn't changed. Listings are
+ * moved in and out of the cache rather than copied. The least recently used
+ * listings are dropped once the cache grows past CACHE_SIZE megabytes.
+ * Sizes and times aren't cached, since files can change without their
+ * directory changing.
+ */
+#define CACHE_BUCKETS 127U // prime number
+#define cachehashfn(ino) ((unsigned)(ino) % CACHE_BUCKETS)
+
+struct cachedlist {
+    struct listkey key;
+    struct listelem* list;
+    size_t count;
+    struct names names;
+    enum sortmode mode;
+    struct liststats stats;
+    struct cachedlist* next;    // next in the hash chain
+    struct cachedlist* newer;   // LRU order
+    struct cachedlist* older;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct cachedlist* table[CACHE_BUCKETS];
+    struct cachedlist* newest;
+    struct cachedlist* oldest;
+    size_t bytes;
+} listcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Fills in a key for a directory. Directories which have been modified in
+ * the last second or so get an invalid key, since another change within the
+ * resolution of the timestamps wouldn't show up.
+ */
+static void makekey(struct listkey* k, const struct stat* st, bool hidden) {
+    time_t now = time(NULL);
+    k->hidden = hidden;
+    k->dev = st->st_dev;
+    k->ino = st->st_ino;
+    k->mtime = st->st_mtim;
+    k->ctime = st->st_ctim;
+    k->valid = k->mtime.tv_sec < now - 1 && k->ctime.tv_sec < now - 1;
+}
+
+/*
+ * Removes an entry from the cache. The lock must be held.
+ */
+static void cache_unlink(struct cachedlist* c) {
+    struct cachedlist** p = &listcache.table[cachehashfn(c->key.ino)];
+    while (*p != c) {
+        p = &(*p)->next;
+    }
+    *p = c->next;
+
+    if (c->newer) {
+        c->newer->older = c->older;
+    } else {
+        listcache.newest = c->older;
+    }
+    if (c->older) {
+        c->older->newer = c->newer;
+    } else {
+        listcache.oldest = c->newer;
+    }
+
+    listcache.bytes -= c->count * sizeof(*c->list) + c->names.len;
+}
+
+static void cache_free(struct cachedlist* c) {
+    free(c->list);
+    free(c->names.buf);
+    free(c);
+}
+
+/*
+ * Puts a listing into the cache, which takes ownership of the list and its
+ * names. Both are shrunk to fit, since cached listings are never added to.
+ */
+static void cache_put(const struct listkey* k, struct listelem* list, size_t count, struct names* names, enum sortmode mode, const struct liststats* stats) {
+    size_t bytes = count * sizeof(*list) + names->len;
+    if (!k->valid || bytes > (size_t)CACHE_SIZE * 1024 * 1024) {
+        free(list);
+        free(names->buf);
+        return;
+    }
+
+    struct cachedlist* c = malloc(sizeof(*c));
+    if (!c) {
+        free(list);
+        free(names->buf);
+        return;
+    }
+    c->key = *k;
+    c->count = count;
+    c->mode = mode;
+    c->stats = *stats;
+    c->list = realloc(list, count ? count * sizeof(*list) : 1);
+    if (!c->list) {
+        c->list = list;
+    }
+    c->names.len = c->names.size = names->len;
+    c->names.buf = realloc(names->buf, names->len ? names->len : 1);
+    if (!c->names.buf) {
+        c->names.buf = names->buf;
+        c->names.size = names->size;
+    }
+
+    pthread_mutex_lock(&listcache.lock);
+    for (struct cachedlist* o = listcache.table[cachehashfn(k->ino)]; o; o = o->next) {
+        if (o->key.dev == k->dev && o->key.ino == k->ino && o->key.hidden == k->hidden) {
+            cache_unlink(o);
+            cache_free(o);
+            break;
+        }
+    }
+
+    c->next = listcache.table[cachehashfn(k->ino)];
+    listcache.table[cachehashfn(k->ino)] = c;
+    c->newer = NULL;
+    c->older = listcache.newest;
+    if (listcache.newest) {
+        listcache.newest->newer = c;
+    } else {
+        listcache.oldest = c;
+    }
+    listcache.newest = c;
+    listcache.bytes += bytes;
+
+    while (listcache.bytes > (size_t)CACHE_SIZE * 1024 * 1024) {
+        struct cachedlist* o = listcache.oldest;
+        cache_unlink(o);
+        cache_free(o);
+    }
+    pthread_mutex_unlock(&listcache.lock);
+}
+
+/*
+ * Takes a listing back out of the cache if there is one which matches the key.
+ * Returns NULL if there isn't, else the caller owns the returned entry and
+ * should free it with free() once the list has been taken out of it.
+ */
+static struct cachedlist* cache_take(const struct listkey* k) {
+    struct cachedlist* c;
+
+    if (!k->valid) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&listcache.lock);
+    for (c = listcache.table[cachehashfn(k->ino)]; c; c = c->next) {
+        if (c->key.dev == k->dev && c->key.ino == k->ino && c->key.hidden == k->hidden) {
+            cache_unlink(c);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&listcache.lock);
+
+    if (c && (c->key.mtime.tv_sec != k->mtime.tv_sec
+                || c->key.mtime.tv_nsec != k->mtime.tv_nsec
+                || c->key.ctime.tv_sec != k->ctime.tv_sec
+                || c->key.ctime.tv_nsec != k->ctime.tv_nsec)) {
+        // the directory changed since it was cached
+        cache_free(c);
+        c = NULL;
+    }
+
+    return c;
+}
+
+/*
+ * Returns the number of milliseconds since some arbitrary point.
+ */
+static long long msnow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Directory watches. On Linux, the directory being shown is watched with
+ * inotify so that changes can be patched into the list as they happen,
+ * instead of reading the whole directory again. Watches are added by the scan
+ * threads before they read a directory, so nothing is missed in between, and
+ * are refcounted since every watch on the same directory shares a descriptor.
+ */
+static int inofd = -1;
+
+#ifdef __linux__
+# define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+        | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static pthread_mutex_t watchlock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    int wd;
+    int refs;
+}* watches;
+static size_t nwatches;
+#endif
+
+/*
+ * Watches the directory open at fd, returning the watch descriptor or -1.
+ */
+static int watch_add(int fd) {
+#ifdef __linux__
+    char path[64];
+    int wd = -1;
+
+    if (inofd < 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    pthread_mutex_lock(&watchlock);
+    wd = inotify_add_watch(inofd, path, WATCH_MASK);
+    if (wd >= 0) {
+        size_t i;
+        for (i = 0; i < nwatches && watches[i].wd != wd; i++);
+        if (i == nwatches) {
+            void* w = realloc(watches, (nwatches + 1) * sizeof(*watches));
+            if (!w) {
+                inotify_rm_watch(inofd, wd);
+                pthread_mutex_unlock(&watchlock);
+                return -1;
+            }
+            watches = w;
+            watches[nwatches].wd = wd;
+            watches[nwatches].refs = 0;
+            nwatches++;
+        }
+        watches[i].refs++;
+    }
+    pthread_mutex_unlock(&watchlock);
+
+    return wd;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+/*
+ * Drops a reference to a watch, removing it if it was the last one.
+ */
+static void watch_drop(int wd) {
+#ifdef __linux__
+    if (wd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&watchlock);
+    for (size_t i = 0; i < nwatches; i++) {
+        if (watches[i].wd == wd) {
+            if (--watches[i].refs == 0) {
+                inotify_rm_watch(inofd, wd);
+                watches[i] = watches[--nwatches];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watchlock);
+#else
+    (void)wd;
+#endif
+}
+
+enum scanstate {
+    SCAN_READING,
+    SCAN_SORTING,
+    SCAN_DONE,
+    SCAN_FAILED,
+};
+
+/*
+ * A directory scan. Each scan runs on its own thread, so that a directory
+ * which is slow to open or read (such as one on a hung network mount) can't
+ * hold up the UI, or the scans which come after it.
+ *
+ * Everything below 'lock' is protected by scanlock. The entries in the list
+ * up to 'count' can be copied by the UI while the state is SCAN_READING; the
+ * list belongs to the scan thread again once it starts sorting.
+ */
+struct scanjob {
+    unsigned long gen;
+    bool hidden;
+    bool usecache;
+    enum sortmode mode;
+    struct entryinfo* info; // only filled for modes which need it
+    size_t infosize;
+    char path[PATH_MAX+1];
+    struct listkey key;
+    struct liststats stats;
+    size_t filled;
+    int fd;
+    int watch;
+    // lock
+    int refs;
+    enum scanstate state;
+    int err;
+    struct listelem* list;
+    size_t listsize;
+    size_t count;
+    struct names names;
+    size_t nameslen; // how much of names goes with the first count entries
+};
+
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+
+// the latest scan generation; older scans stop as soon as they notice
+static atomic_ulong scangen;
+
+// pipe used by scan threads to wake up the main loop
+static int scanwake[2] = { -1, -1 };
+
+// the scan for the directory being shown, and how much of it has been copied
+static struct {
+    struct scanjob* job;
+    size_t have;
+    size_t havenames;
+} scan;
+
+/*
+ * The listing of a directory. Each view holds a reference to the listing it
+ * shows, and views showing the same directory share one, so switching between
+ * them doesn't require reading anything. A listing is complete once its scan
+ * has finished, after which it is kept up to date through its watch, if it
+ * has one. If it can't be, it is marked stale and read again when it's next
+ * shown.
+ */
+struct listing {
+    int refs;
+    bool complete;
+    bool stale;
+    bool patched;
+    bool hidden;
+    enum sortmode mode;
+    char path[PATH_MAX+1];
+    struct listelem* list;
+    size_t listsize;
+    size_t count;
+    struct names names;
+    size_t garbage; // bytes of names no longer used by any entry
+    struct entryinfo* info; // indexed by id, kept up to date once there
+    size_t infosize;
+    uint32_t nextid;
+    struct inoset ids; // ids by name, when sorted by size or time, see findname()
+    size_t marks;
+    int fd;
+    int watch;
+    struct listkey key;
+    struct liststats stats;
+};
+
+/*
+ * A filter narrowing what a view shows to the entries whose names contain
+ * some text. While it's in use, the view's selection and position are
+ * indices into idx, which holds the indices of the matching entries in
+ * listing order.
+ */
+struct filter {
+    char str[NAME_MAX+1];
+    size_t len; // the filter is only in use if this isn't 0
+    bool fold; // ignore case, since there are no capitals in str
+    uint32_t* idx;
+    size_t count;
+    size_t size;
+};
+
+struct view {
+    char* wd;
+    const char* eprefix;
+    const char* emsg;
+    bool errorshown;
+    bool einfo; // the message isn't an error, and goes away with the next key
+    size_t selection;
+    size_t pos;
+    struct listing* ls;
+    struct savedpos* backstack;
+    struct filter filter;
+};
+
+// the listing being shown
+static struct listing* shown;
+
+/*
+ * Creates an empty listing for a directory.
+ */
+static struct listing* listing_new(const char* path, bool hidden, enum sortmode mode) {
+    struct listing* l = calloc(1, sizeof(*l));
+    if (!l) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    l->refs = 1;
+    l->hidden = hidden;
+    l->mode = mode;
+    strncpy(l->path, path, PATH_MAX);
+    l->fd = -1;
+    l->watch = -1;
+
+    return l;
+}
+
+/*
+ * Drops a reference to a listing. The last one hands a complete listing to
+ * the cache, and frees the rest.
+ */
+static void listing_release(struct listing* l) {
+    if (!l || --l->refs > 0) {
+        return;
+    }
+
+    if (l->complete && !l->stale && l->key.valid) {
+        cache_put(&l->key, l->list, l->count, &l->names, l->mode, &l->stats);
+    } else {
+        free(l->list);
+        free(l->names.buf);
+    }
+    free(l->info);
+    inoset_free(&l->ids);
+    if (l->fd >= 0) {
+        close(l->fd);
+    }
+    watch_drop(l->watch);
+    free(l);
+}
+
+/*
+ * Finds a listing of path which is up to date and shown by a view other than
+ * 'self', so that it can be shared.
+ */
+static struct listing* listing_find(struct view* views, int n, const struct view* self, const char* path, bool hidden, enum sortmode mode) {
+    for (int i = 0; i < n; i++) {
+        struct listing* l = views[i].ls;
+        if (&views[i] != self && l && l->complete && !l->stale
+                && l->hidden == hidden && l->mode == mode
+                && 0 == strcmp(l->path, path)) {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the name of the i'th entry of a listing.
+ */
+static char* nameof(const struct listing* l, size_t i) {
+    return entryname(l->names.buf + l->list[i].name);
+}
+
+/*
+ * Returns the number of entries a view shows.
+ */
+static size_t viewcount(const struct view* v) {
+    return v->filter.len ? v->filter.count : v->ls->count;
+}
+
+/*
+ * Returns the listing index of the i'th entry shown by a view.
+ */
+static size_t viewindex(const struct view* v, size_t i) {
+    return (v->filter.len && i < v->filter.count) ? v->filter.idx[i] : i;
+}
+
+/*
+ * Returns the i'th entry shown by a view.
+ */
+static struct listelem* elemat(const struct view* v, size_t i) {
+    return &v->ls->list[viewindex(v, i)];
+}
+
+/*
+ * Returns the name of the i'th entry shown by a view.
+ */
+static char* nameat(const struct view* v, size_t i) {
+    return nameof(v->ls, viewindex(v, i));
+}
+
+/*
+ * Moves a view's selection to the i'th entry it shows, leaving the entry on
+ * the same row if it's still on screen, else putting it in the middle.
+ */
+static void view_select(struct view* v, size_t i) {
+    size_t top = v->selection - v->pos;
+    v->selection = i;
+    if (i >= top && i - top < (size_t)rows - 2) {
+        v->pos = i - top;
+    } else {
+        v->pos = (i > (size_t)rows - 2) ? (size_t)rows/2 : i;
+    }
+}
+
+/*
+ * Returns the map from what a view shows to its listing, for drawing, or
+ * NULL if they're the same.
+ */
+static const uint32_t* viewmap(const struct view* v) {
+    return v->filter.len ? v->filter.idx : NULL;
+}
+
+// for looking at a word's worth of bytes at a time
+#define SWAR_ONES ((uint64_t)-1 / 0xff)
+#define SWAR_HIGHS (SWAR_ONES * 0x80)
+#define SWAR_HASZERO(w) (((w) - SWAR_ONES) & ~(w) & SWAR_HIGHS)
+
+/*
+ * Returns the first byte in the string s which is either a or b, or its
+ * terminating null. Bytes before end are looked at eight at a time.
+ */
+static const char* findbyte(const char* s, const char* end, unsigned char a, unsigned char b) {
+    uint64_t wa = SWAR_ONES * a;
+    uint64_t wb = SWAR_ONES * b;
+
+    while (s + sizeof(uint64_t) <= end) {
+        uint64_t w;
+        memcpy(&w, s, sizeof(w));
+        if (SWAR_HASZERO(w) | SWAR_HASZERO(w ^ wa) | SWAR_HASZERO(w ^ wb)) {
+            break;
+        }
+        s += sizeof(w);
+    }
+
+    for (; *s && (unsigned char)*s != a && (unsigned char)*s != b; s++);
+    return s;
+}
+
+/*
+ * Returns whether a name matches a filter. The name must be in a listing's
+ * names, which end no sooner than end.
+ */
+static bool filter_match(const struct filter* f, const char* name, const char* end) {
+    unsigned char a = f->str[0];
+    unsigned char b = f->fold ? toupper(a) : a;
+
+    for (const char* p = name; *(p = findbyte(p, end, a, b)); p++) {
+        size_t i = 1;
+        if (f->fold) {
+            for (; i < f->len && tolower((unsigned char)p[i]) == (unsigned char)f->str[i]; i++);
+        } else {
+            for (; i < f->len && p[i] == f->str[i]; i++);
+        }
+        if (i == f->len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Returns the first position in a filter's results whose entry is at i or
+ * after it in the listing.
+ */
+static size_t filter_find(const struct filter* f, size_t i) {
+    size_t lo = 0, hi = f->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (f->idx[mid] < i) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Applies a view's filter to its listing, keeping the selection on the entry
+ * at sel in the listing if it's still shown. If narrow is set, the filter
+ * only got longer, so just the entries it matched before are looked at.
+ */
+static void filter_run(struct view* v, bool narrow, size_t sel) {
+    struct filter* f = &v->filter;
+    struct listing* ls = v->ls;
+    const char* end = ls->names.buf + ls->names.len;
+
+    f->fold = true;
+    for (size_t i = 0; i < f->len; i++) {
+        if (isupper((unsigned char)f->str[i])) {
+            f->fold = false;
+        }
+    }
+
+    size_t n = 0;
+    if (narrow) {
+        for (size_t i = 0; i < f->count; i++) {
+            if (filter_match(f, nameof(ls, f->idx[i]), end)) {
+                f->idx[n++] = f->idx[i];
+            }
+        }
+    } else {
+        if (f->size < ls->count) {
+            free(f->idx);
+            f->size = ls->count;
+            f->idx = malloc(f->size * sizeof(*f->idx));
+            if (!f->idx) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t i = 0; i < ls->count; i++) {
+            if (filter_match(f, nameof(ls, i), end)) {
+                f->idx[n++] = (uint32_t)i;
+            }
+        }
+    }
+    f->count = n;
+
+    size_t i = filter_find(f, sel);
+    if (i < f->count && f->idx[i] == sel) {
+        view_select(v, i);
+    } else {
+        v->selection = 0;
+        v->pos = 0;
+    }
+}
+
+/*
+ * Stops filtering a view, keeping the selection on the same entry. The text
+ * of the filter is left so that it can be put back.
+ */
+static void filter_clear(struct view* v) {
+    if (!v->filter.len) {
+        return;
+    }
+
+    size_t i = (v->selection < viewcount(v)) ? viewindex(v, v->selection) : 0;
+    v->filter.len = 0;
+    v->filter.count = 0;
+    v->selection = i;
+    if (v->pos > i) {
+        v->pos = i;
+    }
+}
+
+/*
+ * Wakes up the main loop.
+ */
+static void scan_notify(void) {
+    char c = 0;
+    (void)!write(scanwake[1], &c, 1);
+}
+
+/*
+ * Drops a reference to a scan job, freeing it if it was the last one.
+ */
+static void scan_release(struct scanjob* j) {
+    pthread_mutex_lock(&scanlock);
+    bool last = (--j->refs == 0);
+    pthread_mutex_unlock(&scanlock);
+
+    if (last) {
+        if (j->fd >= 0) {
+            close(j->fd);
+        }
+        watch_drop(j->watch);
+        free(j->list);
+        free(j->names.buf);
+        free(j->info);
+        free(j);
+    }
+}
+
+/*
+ * Reads up to SCAN_BATCH more entries into the job's list.
+ * Returns true once the end of the directory has been reached.
+ */
+static bool scan_step(struct scanjob* j, struct dirreader* r) {
+    const char* name;
+    unsigned char dtype;
+
+    for (size_t n = 0; n < SCAN_BATCH; n++) {
+        if (!dr_next(r, &name, &dtype)) {
+            return true;
+        }
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        if (!j->hidden && name[0] == '.') {
+            continue;
+        }
+
+        enum elemtype type;
+        struct entryinfo* info = NULL;
+        if (SORT_NEEDS_INFO(j->mode)) {
+            // only the scan thread uses this until it's done
+            growinfo(&j->info, &j->infosize, j->filled + 1);
+            info = &j->info[j->filled];
+        }
+        int c = classify(r->fd, name, dtype, &type, LAZY_STAT, info, &j->stats);
+        if (c < 0) {
+            continue;
+        }
+
+        if (j->names.len + ENTRY_MAX > UINT32_MAX) {
+            continue;
+        }
+
+        if (j->filled == j->listsize || j->names.len + ENTRY_MAX > j->names.size) {
+            // the UI may be copying out of the list
+            pthread_mutex_lock(&scanlock);
+            growlist(&j->list, &j->listsize, j->filled + 1);
+            grownames(&j->names, j->names.len + ENTRY_MAX);
+            pthread_mutex_unlock(&scanlock);
+        }
+
+        struct listelem* e = &(j->list[j->filled]);
+        e->name = addname(&j->names, E_DIR(type), name);
+        e->id = (uint32_t)j->filled;
+        e->type = type;
+        e->marked = false;
+        e->pending = (c == 1);
+
+        j->filled++;
+    }
+
+    return false;
+}
+
+/*
+ * Body of a scan thread.
+ */
+static void* scan_thread(void* arg) {
+    struct scanjob* j = arg;
+    struct dirreader r;
+
+    if (0 != dr_open(&r, j->path, &j->stats)) {
+        pthread_mutex_lock(&scanlock);
+        j->err = errno;
+        j->state = SCAN_FAILED;
+        pthread_mutex_unlock(&scanlock);
+        scan_notify();
+        scan_release(j);
+        return NULL;
+    }
+
+    // watch first, so that any change after the key is taken is reported
+    j->watch = watch_add(r.fd);
+
+    struct stat st;
+    if (0 == fstat(r.fd, &st)) {
+        makekey(&j->key, &st, j->hidden);
+    }
+
+    // the cache has no sizes or times to sort by
+    struct cachedlist* c = (j->usecache && !SORT_NEEDS_INFO(j->mode)) ? cache_take(&j->key) : NULL;
+    if (c) {
+        j->fd = dup(r.fd);
+        dr_close(&r);
+
+        // marks aren't kept when leaving a directory
+        for (size_t i = 0; i < c->count; i++) {
+            c->list[i].marked = false;
+            c->list[i].id = (uint32_t)i;
+        }
+
+        if (c->mode != j->mode) {
+            sortlist(c->list, c->count, c->names.buf, NULL, j->mode);
+        }
+
+        pthread_mutex_lock(&scanlock);
+        free(j->list);
+        free(j->names.buf);
+        j->list = c->list;
+        j->listsize = j->filled = j->count = c->count;
+        j->names = c->names;
+        j->nameslen = c->names.len;
+        j->stats = c->stats;
+        j->stats.cached = true;
+        j->state = SCAN_DONE;
+        pthread_mutex_unlock(&scanlock);
+        free(c);
+
+        scan_notify();
+        scan_release(j);
+        return NULL;
+    }
+
+    long long last = 0;
+    bool done = false;
+    while (!done && atomic_load(&scangen) == j->gen) {
+        done = scan_step(j, &r);
+
+        pthread_mutex_lock(&scanlock);
+        j->count = j->filled;
+        j->nameslen = j->names.len;
+        pthread_mutex_unlock(&scanlock);
+
+        if (!done && msnow() - last >= SCAN_STATUS_MS) {
+            last = msnow();
+            scan_notify();
+        }
+    }
+
+    if (done) {
+        // keep the directory open so that pending entries can be resolved
+        j->fd = dup(r.fd);
+    }
+    dr_close(&r);
+
+    if (done) {
+        pthread_mutex_lock(&scanlock);
+        j->state = SCAN_SORTING;
+        pthread_mutex_unlock(&scanlock);
+
+        sortlist(j->list, j->filled, j->names.buf, j->info, j->mode);
+        j->stats.entries = j->filled;
+
+        pthread_mutex_lock(&scanlock);
+        j->state = SCAN_DONE;
+        pthread_mutex_unlock(&scanlock);
+        scan_notify();
+    }
+
+    scan_release(j);
+    return NULL;
+}
+
+/*
+ * Starts reading a directory in the background, abandoning any scan already
+ * in progress, to be sorted by the given mode. Results are picked up with
+ * scan_collect(). If usecache is set, a cached listing will be used if the
+ * directory hasn't changed.
+ */
+static void scan_start(const char* path, bool hidden, enum sortmode mode, bool usecache) {
+    if (scanwake[0] < 0) {
+        if (0 != pipe(scanwake)) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < 2; i++) {
+            fcntl(scanwake[i], F_SETFL, O_NONBLOCK);
+            fcntl(scanwake[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (scan.job) {
+        scan_release(scan.job);
+    }
+
+    struct scanjob* j = calloc(1, sizeof(*j));
+    if (!j) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    j->gen = atomic_fetch_add(&scangen, 1) + 1;
+    j->hidden = hidden;
+    j->mode = mode;
+    j->usecache = usecache;
+    strncpy(j->path, path, PATH_MAX);
+    j->fd = -1;
+    j->watch = -1;
+    j->refs = 2;
+    j->state = SCAN_READING;
+
+    scan.job = j;
+    scan.have = 0;
+    scan.havenames = 0;
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (0 != pthread_create(&t, &attr, scan_thread, j)) {
+        // no thread, so just read it here
+        scan_thread(j);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Stops the current scan, if there is one.
+ */
+static void scan_cancel(void) {
+    if (scan.job) {
+        atomic_fetch_add(&scangen, 1);
+        scan_release(scan.job);
+        scan.job = NULL;
+    }
+}
+
+/*
+ * Waits until the current scan has something new to report.
+ */
+static void scan_wait(void) {
+    struct pollfd pfd = {
+        .fd = scanwake[0],
+        .events = POLLIN,
+    };
+    (void)poll(&pfd, 1, -1);
+}
+
+/*
+ * Picks up the results of the current scan into ls. While it is still
+ * reading, any new entries are copied to the end of its list and SCAN_READING
+ * is returned. Once it's done, the list is replaced by the sorted one, the
+ * listing is marked complete, and SCAN_DONE is returned. Returns SCAN_FAILED and sets errno if
+ * the directory couldn't be read.
+ */
+static enum scanstate scan_collect(struct listing* ls) {
+    char buf[64];
+    while (read(scanwake[0], buf, sizeof(buf)) > 0);
+
+    struct scanjob* j = scan.job;
+    pthread_mutex_lock(&scanlock);
+    enum scanstate state = j->state;
+
+    if (state == SCAN_READING && j->count > scan.have) {
+        // names are added in the same order, so offsets stay the same
+        growlist(&ls->list, &ls->listsize, j->count);
+        grownames(&ls->names, j->nameslen);
+        memcpy(ls->list + scan.have, j->list + scan.have,
+                (j->count - scan.have) * sizeof(*ls->list));
+        memcpy(ls->names.buf + scan.havenames, j->names.buf + scan.havenames,
+                j->nameslen - scan.havenames);
+        ls->names.len = j->nameslen;
+        scan.have = j->count;
+        scan.havenames = j->nameslen;
+    }
+    pthread_mutex_unlock(&scanlock);
+
+    switch (state) {
+        case SCAN_READING:
+        case SCAN_SORTING:
+            ls->count = scan.have;
+            return SCAN_READING;
+        case SCAN_FAILED:
+            {
+                int e = j->err;
+                scan_release(j);
+                scan.job = NULL;
+                errno = e;
+            }
+            return SCAN_FAILED;
+        case SCAN_DONE:
+            break;
+    }
+
+    // carry over anything marked while the list was loading
+    for (size_t i = 0; i < scan.have; i++) {
+        if (ls->list[i].marked) {
+            for (size_t x = 0; x < j->filled; x++) {
+                if (0 == strcmp(entryname(ls->names.buf + ls->list[i].name),
+                            entryname(j->names.buf + j->list[x].name))) {
+                    j->list[x].marked = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // swap lists with the job, which will free ours
+    struct listelem* l = ls->list;
+    size_t size = ls->listsize;
+    struct names n = ls->names;
+    ls->list = j->list;
+    ls->listsize = j->listsize;
+    ls->names = j->names;
+    ls->garbage = 0;
+    j->list = l;
+    j->listsize = size;
+    j->names = n;
+
+    ls->fd = j->fd;
+    j->fd = -1;
+    ls->watch = j->watch;
+    j->watch = -1;
+    free(ls->info);
+    ls->info = j->info;
+    ls->infosize = j->infosize;
+    j->info = NULL;
+    ls->mode = j->mode;
+    ls->nextid = (uint32_t)j->filled;
+    inoset_free(&ls->ids);
+    if (SORT_NEEDS_INFO(ls->mode)) {
+        // entries added later need somewhere to go, even if it was empty
+        growinfo(&ls->info, &ls->infosize, 1);
+    }
+
+    ls->stats = j->stats;
+    ls->key = j->key;
+    ls->count = j->filled;
+    ls->complete = true;
+
+    ls->marks = 0;
+    for (size_t i = 0; i < ls->count; i++) {
+        ls->marks += ls->list[i].marked;
+    }
+
+    scan_release(j);
+    scan.job = NULL;
+    return SCAN_DONE;
+}
+
+#if FILE_INDEX
+/*
+ * File index. The tree below a directory can be read in the background so
+ * that any path in it can be found by typing part of it. Each node holds its
+ * parent and name, and the children of a directory are added together once
+ * it has been read, after their parent, so one pass in order can follow
+ * every path down from the root. Changes made in cfm are patched in: new
+ * entries are added at the end and listed as extras of their directory, and
+ * removed ones are marked dead.
+ */
+#define INDEX_FILE UINT32_MAX          // first of a node which isn't a directory
+#define INDEX_UNREAD (UINT32_MAX - 1)  // first of a directory not read (yet)
+#define INDEX_DEAD (UINT32_MAX - 2)    // first of a node which was removed
+#define INDEX_NONE UINT32_MAX
+
+// deepest the index goes below its root, which is also the most directories
+// it holds open at once
+#define INDEX_DEPTH_MAX 64
+
+struct indexnode {
+    uint32_t parent;
+    uint32_t name; // offset into the index's names
+    uint32_t first; // index of the first child, or one of the above
+    uint32_t count; // number of children
+};
+
+// a directory being walked by the indexer
+struct indexdir {
+    int fd;
+    uint32_t next;
+    uint32_t end;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t built; // signalled once done is set
+    atomic_ulong gen;
+    bool done;
+    bool hidden;
+    char root[PATH_MAX+1];
+    struct indexnode* nodes;
+    size_t count;
+    size_t size;
+    struct names names;
+    uint32_t* extra; // nodes added after their directory was read
+    size_t nextra;
+    size_t extrasize;
+} fileindex = { .lock = PTHREAD_MUTEX_INITIALIZER, .built = PTHREAD_COND_INITIALIZER };
+
+/*
+ * Appends nodes to the index, whose names are given relative to names.
+ * Returns the index of the first one. The lock must be held.
+ */
+static uint32_t index_append(const struct indexnode* n, size_t count, const char* names, size_t len) {
+    if (fileindex.count + count > fileindex.size) {
+        size_t size = fileindex.size ? fileindex.size : LIST_ALLOC_SIZE;
+        while (size < fileindex.count + count) {
+            size *= 2;
+        }
+        struct indexnode* nodes = realloc(fileindex.nodes, size * sizeof(*nodes));
+        if (!nodes) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        fileindex.nodes = nodes;
+        fileindex.size = size;
+    }
+    grownames(&fileindex.names, fileindex.names.len + len);
+
+    uint32_t first = fileindex.count;
+    for (size_t i = 0; i < count; i++) {
+        fileindex.nodes[first + i] = n[i];
+        fileindex.nodes[first + i].name += fileindex.names.len;
+    }
+    memcpy(fileindex.names.buf + fileindex.names.len, names, len);
+    fileindex.names.len += len;
+    fileindex.count += count;
+
+    return first;
+}
+
+/*
+ * Reads the directory at path relative to dfd and adds its entries as the
+ * children of node, leaving out hidden ones unless hidden is set. Directories
+ * on other devices than dev aren't read.
+ * Returns an fd for the directory, or -1 if it couldn't be read or the index
+ * has been started over.
+ */
+static int index_read(unsigned long gen, int dfd, const char* path, uint32_t node, dev_t dev, bool hidden) {
+    struct liststats stats = {0};
+    struct dirreader r;
+    struct stat st;
+
+    if (0 != dr_openat(&r, dfd, path, (dfd == AT_FDCWD) ? 0 : O_NOFOLLOW, &stats)) {
+        return -1;
+    }
+    if (0 != fstat(r.fd, &st) || st.st_dev != dev) {
+        dr_close(&r);
+        return -1;
+    }
+
+    struct indexnode* n = NULL;
+    size_t count = 0, size = 0;
+    struct names names = {0};
+    const char* name;
+    unsigned char dtype;
+    while (dr_next(&r, &name, &dtype)) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (!hidden && name[0] == '.') {
+            continue;
+        }
+        if (dtype == DT_UNKNOWN) {
+            dtype = (0 == fstatat(r.fd, name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+        }
+
+        if (count == size) {
+            size = size ? size * 2 : LIST_ALLOC_SIZE;
+            struct indexnode* g = realloc(n, size * sizeof(*n));
+            if (!g) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            n = g;
+        }
+        size_t l = strlen(name) + 1;
+        grownames(&names, names.len + l);
+        memcpy(names.buf + names.len, name, l);
+        n[count++] = (struct indexnode){
+            .parent = node,
+            .name = names.len,
+            .first = (dtype == DT_DIR) ? INDEX_UNREAD : INDEX_FILE,
+        };
+        names.len += l;
+    }
+
+    int fd = dup(r.fd);
+    dr_close(&r);
+
+    pthread_mutex_lock(&fileindex.lock);
+    if (atomic_load(&fileindex.gen) != gen || fileindex.count + count > INDEX_DEAD
+            || fileindex.names.len + names.len > UINT32_MAX) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    } else if (fileindex.nodes[node].first == INDEX_UNREAD) {
+        // index_append() may move the nodes
+        uint32_t first = index_append(n, count, names.buf, names.len);
+        fileindex.nodes[node].first = first;
+        fileindex.nodes[node].count = count;
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+
+    free(n);
+    free(names.buf);
+    return fd;
+}
+
+/*
+ * Pushes a directory which index_read() returned fd for onto the indexer's
+ * stack, so that its children get walked.
+ */
+static void index_push(unsigned long gen, struct indexdir* stack, int* depth, int fd, uint32_t node) {
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&fileindex.lock);
+    if (atomic_load(&fileindex.gen) == gen) {
+        struct indexnode* n = &fileindex.nodes[node];
+        stack[(*depth)++] = (struct indexdir){ fd, n->first, n->first + n->count };
+        fd = -1;
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * Body of the indexing thread. Walks the tree depth first, opening each
+ * directory relative to its parent, and stops as soon as the index is
+ * started over.
+ */
+static void* index_thread(void* arg) {
+    unsigned long gen = (unsigned long)(uintptr_t)arg;
+    struct indexdir stack[INDEX_DEPTH_MAX];
+    int depth = 0;
+    char root[PATH_MAX+1];
+    char name[NAME_MAX+1];
+    bool hidden;
+    struct stat st;
+
+    pthread_mutex_lock(&fileindex.lock);
+    strcpy(root, fileindex.root);
+    hidden = fileindex.hidden;
+    pthread_mutex_unlock(&fileindex.lock);
+
+    if (0 == stat(root, &st)) {
+        index_push(gen, stack, &depth, index_read(gen, AT_FDCWD, root, 0, st.st_dev, hidden), 0);
+    }
+
+    while (depth > 0 && atomic_load(&fileindex.gen) == gen) {
+        struct indexdir* d = &stack[depth-1];
+        if (d->next == d->end) {
+            close(d->fd);
+            depth--;
+            continue;
+        }
+
+        uint32_t i = d->next++;
+        bool dir = false;
+        pthread_mutex_lock(&fileindex.lock);
+        if (atomic_load(&fileindex.gen) == gen) {
+            dir = fileindex.nodes[i].first == INDEX_UNREAD;
+            strcpy(name, fileindex.names.buf + fileindex.nodes[i].name);
+        }
+        pthread_mutex_unlock(&fileindex.lock);
+
+        if (!dir || depth == INDEX_DEPTH_MAX) {
+            continue;
+        }
+
+        index_push(gen, stack, &depth, index_read(gen, d->fd, name, i, st.st_dev, hidden), i);
+    }
+
+    while (depth > 0) {
+        close(stack[--depth].fd);
+    }
+
+    pthread_mutex_lock(&fileindex.lock);
+    if (atomic_load(&fileindex.gen) == gen) {
+        fileindex.done = true;
+        pthread_cond_broadcast(&fileindex.built);
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+
+    return NULL;
+}
+
+/*
+ * Starts indexing the tree below root in the background, throwing away the
+ * current index.
+ */
+static void index_start(const char* root, bool hidden) {
+    pthread_mutex_lock(&fileindex.lock);
+    unsigned long gen = atomic_fetch_add(&fileindex.gen, 1) + 1;
+    strncpy(fileindex.root, root, PATH_MAX);
+    fileindex.hidden = hidden;
+    fileindex.done = false;
+    fileindex.count = 0;
+    fileindex.names.len = 0;
+    fileindex.nextra = 0;
+    struct indexnode n = { 0, 0, INDEX_UNREAD, 0 };
+    index_append(&n, 1, "", 1);
+    pthread_mutex_unlock(&fileindex.lock);
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (0 != pthread_create(&t, &attr, index_thread, (void*)(uintptr_t)gen)) {
+        pthread_mutex_lock(&fileindex.lock);
+        fileindex.done = true;
+        pthread_cond_broadcast(&fileindex.built);
+        pthread_mutex_unlock(&fileindex.lock);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Finds the child of a directory node by name. The lock must be held.
+ * Returns INDEX_NONE if it isn't there.
+ */
+static uint32_t index_child(uint32_t node, const char* name) {
+    const struct indexnode* n = &fileindex.nodes[node];
+
+    if (n->first < INDEX_DEAD) {
+        for (uint32_t i = n->first; i < n->first + n->count; i++) {
+            const struct indexnode* c = &fileindex.nodes[i];
+            if (c->first != INDEX_DEAD && c->parent == node
+                    && 0 == strcmp(fileindex.names.buf + c->name, name)) {
+                return i;
+            }
+        }
+    }
+    for (size_t x = 0; x < fileindex.nextra; x++) {
+        const struct indexnode* c = &fileindex.nodes[fileindex.extra[x]];
+        if (c->first != INDEX_DEAD && c->parent == node
+                && 0 == strcmp(fileindex.names.buf + c->name, name)) {
+            return fileindex.extra[x];
+        }
+    }
+    return INDEX_NONE;
+}
+
+/*
+ * Finds the node for an absolute path. The lock must be held.
+ * Returns INDEX_NONE if it isn't in the index.
+ */
+static uint32_t index_lookup(const char* path) {
+    size_t rl = strlen(fileindex.root);
+    if (!fileindex.count || 0 != strncmp(path, fileindex.root, rl)
+            || (path[rl] != '/' && path[rl] != '\0' && rl > 1)) {
+        return INDEX_NONE;
+    }
+
+    uint32_t node = 0;
+    const char* p = path + rl;
+    char name[NAME_MAX+1];
+    while (*p && node != INDEX_NONE) {
+        while (*p == '/') {
+            p++;
+        }
+        size_t l = strcspn(p, "/");
+        if (!l) {
+            break;
+        }
+        if (l > NAME_MAX) {
+            return INDEX_NONE;
+        }
+        memcpy(name, p, l);
+        name[l] = '\0';
+        p += l;
+        node = index_child(node, name);
+    }
+    return node;
+}
+
+/*
+ * Adds a path which was just created to the index, if its directory is in
+ * it. A directory which is added isn't read.
+ */
+static void index_add(const char* path) {
+    struct stat st;
+    char dir[PATH_MAX+1];
+    const char* name = strrchr(path, '/');
+
+    if (!name || !name[1] || (!fileindex.hidden && name[1] == '.')
+            || 0 != lstat(path, &st)) {
+        return;
+    }
+    memcpy(dir, path, name - path);
+    dir[name - path] = '\0';
+    name++;
+
+    pthread_mutex_lock(&fileindex.lock);
+    uint32_t parent = index_lookup(dir[0] ? dir : "/");
+    if (parent != INDEX_NONE && fileindex.nodes[parent].first < INDEX_DEAD
+            && index_child(parent, name) == INDEX_NONE
+            && fileindex.count < INDEX_DEAD) {
+        if (fileindex.nextra == fileindex.extrasize) {
+            size_t size = fileindex.extrasize ? fileindex.extrasize * 2 : LIST_ALLOC_SIZE;
+            uint32_t* e = realloc(fileindex.extra, size * sizeof(*e));
+            if (!e) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            fileindex.extra = e;
+            fileindex.extrasize = size;
+        }
+        struct indexnode n = { parent, 0, S_ISDIR(st.st_mode) ? INDEX_UNREAD : INDEX_FILE, 0 };
+        fileindex.extra[fileindex.nextra++] = index_append(&n, 1, name, strlen(name) + 1);
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+}
+
+/*
+ * Removes a path which was just deleted from the index.
+ */
+static void index_remove(const char* path) {
+    pthread_mutex_lock(&fileindex.lock);
+    uint32_t node = index_lookup(path);
+    if (node != INDEX_NONE && node != 0) {
+        fileindex.nodes[node].first = INDEX_DEAD;
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+}
+
+/*
+ * Updates the index after a rename. A node renamed within its directory
+ * keeps what's below it; anything else is removed and added again.
+ */
+static void index_rename(const char* from, const char* to) {
+    const char* f = strrchr(from, '/');
+    const char* t = strrchr(to, '/');
+
+    if (f && t && f - from == t - to && 0 == strncmp(from, to, f - from)
+            && (fileindex.hidden || t[1] != '.')) {
+        pthread_mutex_lock(&fileindex.lock);
+        uint32_t node = index_lookup(from);
+        if (node != INDEX_NONE && node != 0 && fileindex.names.len + NAME_MAX + 1 <= UINT32_MAX) {
+            size_t l = strlen(t + 1) + 1;
+            grownames(&fileindex.names, fileindex.names.len + l);
+            memcpy(fileindex.names.buf + fileindex.names.len, t + 1, l);
+            fileindex.nodes[node].name = fileindex.names.len;
+            fileindex.names.len += l;
+            pthread_mutex_unlock(&fileindex.lock);
+            return;
+        }
+        pthread_mutex_unlock(&fileindex.lock);
+    }
+
+    index_remove(from);
+    index_add(to);
+}
+
+/*
+ * Writes the path of a node relative to the node 'from', which must be one of
+ * its ancestors. The lock must be held.
+ * Returns whether the node is a directory.
+ */
+static bool index_path(uint32_t node, uint32_t from, char* out, size_t size) {
+    // nothing is added below a directory the indexer didn't read
+    const char* parts[INDEX_DEPTH_MAX + 2];
+    int n = 0;
+    for (uint32_t x = node; x != from && n < INDEX_DEPTH_MAX + 2; x = fileindex.nodes[x].parent) {
+        parts[n++] = fileindex.names.buf + fileindex.nodes[x].name;
+    }
+
+    size_t len = 0;
+    out[0] = '\0';
+    while (n-- > 0 && len < size) {
+        len += snprintf(out + len, size - len, "%s%s", len ? "/" : "", parts[n]);
+    }
+
+    return fileindex.nodes[node].first != INDEX_FILE;
+}
+
+/*
+ * Advances the match of a fuzzy query over a string, returning how much of
+ * the query has been matched.
+ */
+static size_t fuzzyadvance(const char* q, size_t qlen, bool fold, size_t m, const char* s) {
+    for (; *s && m < qlen; s++) {
+        unsigned char c = *s;
+        if ((fold ? tolower(c) : c) == (unsigned char)q[m]) {
+            m++;
+        }
+    }
+    return m;
+}
+
+/*
+ * Looks through the index for the paths below the node for dir which contain
+ * the characters of the query in order, ignoring case unless it has capitals.
+ * The best n are stored in out, those whose name alone matches first and
+ * then the shortest, and the node for dir in fromp. Returns how many were
+ * found, or -1 if dir isn't in the index (yet).
+ */
+static ssize_t index_query(const char* dir, const char* q, uint32_t* out, size_t n, uint32_t* fromp) {
+    size_t qlen = strlen(q);
+    bool fold = true;
+    size_t found = 0;
+
+    // matches are tracked in bytes, with one value kept for "not below dir"
+    if (qlen >= 0xFF) {
+        qlen = 0xFE;
+    }
+
+    for (size_t i = 0; i < qlen; i++) {
+        if (isupper((unsigned char)q[i])) {
+            fold = false;
+        }
+    }
+
+    pthread_mutex_lock(&fileindex.lock);
+    uint32_t from = index_lookup(dir);
+    if (from == INDEX_NONE) {
+        pthread_mutex_unlock(&fileindex.lock);
+        return -1;
+    }
+
+    // how much of the query the path down to each node matches, or 0xFF if
+    // it isn't below 'from'
+    unsigned char* state = malloc(fileindex.count);
+    uint32_t* rank = malloc((n ? n : 1) * sizeof(*rank));
+    if (!state || !rank) {
+        pthread_mutex_unlock(&fileindex.lock);
+        free(state);
+        free(rank);
+        return 0;
+    }
+    memset(state, 0xFF, from + 1);
+    state[from] = 0;
+    *fromp = from;
+
+    for (size_t i = from + 1; i < fileindex.count; i++) {
+        const struct indexnode* x = &fileindex.nodes[i];
+        unsigned char p = state[x->parent];
+        if (p == 0xFF || x->first == INDEX_DEAD) {
+            state[i] = 0xFF;
+            continue;
+        }
+        size_t m = p;
+        if (x->parent != from && m < qlen && q[m] == '/') {
+            m++;
+        }
+        const char* name = fileindex.names.buf + x->name;
+        state[i] = fuzzyadvance(q, qlen, fold, m, name);
+        if (state[i] != qlen || !qlen) {
+            continue;
+        }
+
+        // rank by whether the name alone matches, then by length
+        size_t len = 0;
+        for (uint32_t a = i; a != from; a = fileindex.nodes[a].parent) {
+            len += strlen(fileindex.names.buf + fileindex.nodes[a].name) + 1;
+        }
+        uint32_t r = (fuzzyadvance(q, qlen, fold, 0, name) == qlen ? 0 : PATH_MAX + 1) + len;
+        size_t at = found;
+        while (at > 0 && rank[at-1] > r) {
+            at--;
+        }
+        if (at < n) {
+            size_t last = (found < n) ? found : n - 1;
+            memmove(&out[at+1], &out[at], (last - at) * sizeof(*out));
+            memmove(&rank[at+1], &rank[at], (last - at) * sizeof(*rank));
+            out[at] = i;
+            rank[at] = r;
+            if (found < n) {
+                found++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&fileindex.lock);
+    free(state);
+    free(rank);
+    return found;
+}
+
+/*
+ * Returns whether the index is for path and hidden files, or will be once
+ * it's finished.
+ */
+static bool index_covers(const char* path, bool hidden) {
+    pthread_mutex_lock(&fileindex.lock);
+    size_t rl = strlen(fileindex.root);
+    bool covers = fileindex.count && fileindex.hidden == hidden
+        && 0 == strncmp(path, fileindex.root, rl)
+        && (path[rl] == '/' || path[rl] == '\0' || rl == 1)
+        && (!fileindex.done || index_lookup(path) != INDEX_NONE);
+    pthread_mutex_unlock(&fileindex.lock);
+    return covers;
+}
+
+/*
+ * Returns whether the index has finished being built, and stores how many
+ * entries it has so far in count.
+ */
+static bool index_done(size_t* count) {
+    pthread_mutex_lock(&fileindex.lock);
+    bool done = fileindex.done;
+    *count = fileindex.count;
+    pthread_mutex_unlock(&fileindex.lock);
+    return done;
+}
+
+/*
+ * Waits for the index to finish being built.
+ */
+static void index_wait(void) {
+    pthread_mutex_lock(&fileindex.lock);
+    while (!fileindex.done) {
+        pthread_cond_wait(&fileindex.built, &fileindex.lock);
+    }
+    pthread_mutex_unlock(&fileindex.lock);
+}
+
+/*
+ * Writes the path of a node found by index_query() relative to 'from'.
+ * Returns whether it's a directory.
+ */
+static bool index_get(uint32_t node, uint32_t from, char* out, size_t size) {
+    pthread_mutex_lock(&fileindex.lock);
+    bool dir = index_path(node, from, out, size);
+    pthread_mutex_unlock(&fileindex.lock);
+    return dir;
+}
+#else
+static void index_add(const char* UNUSED(path)) {}
+static void index_remove(const char* UNUSED(path)) {}
+static void index_rename(const char* UNUSED(from), const char* UNUSED(to)) {}
+#endif /* FILE_INDEX */
+
+/*
+ * Directory sizes. c computes the disk usage of a directory on a pool of
+ * threads, each directory being one task. Every directory's total is added to its
+ * parent's once all of its subdirectories are done, and kept in a cache keyed
+ * by its inode, so that the sizes of the directories below it can be shown
+ * without walking them again, for as long as their mtime doesn't change.
+ * Files with several links are only counted the first time they're seen, and
+ * other filesystems aren't walked into, like du -x.
+ */
+#define DU_THREADS_MAX 16
+
+// most directories whose sizes are remembered
+#define DU_CACHE_MAX (1U << 20)
+
+struct dusize {
+    struct timespec mtime;
+    int64_t bytes;
+    int64_t files;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct inoset index; // values are indices into sizes
+    // by namekey(), the paths sizes were found at, which only save stat()ing
+    // any others, so a key two paths share costs no more than a stat()
+    struct inoset paths;
+    struct dusize* sizes;
+    size_t count;
+    size_t size;
+} ducache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct dunode {
+    struct dunode* parent;
+    atomic_int_fast64_t bytes;
+    atomic_int_fast64_t files;
+    atomic_long pending; // subdirectories still being walked, plus one until it's read
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char path[];
+};
+
+struct dujob {
+    struct pool pool; // first, so that tasks can get at the job
+    atomic_int refs;
+    atomic_bool cancelled;
+    atomic_bool done;
+    atomic_int_fast64_t bytes; // running totals
+    atomic_int_fast64_t files;
+    dev_t dev;
+    char root[PATH_MAX+1];
+    pthread_mutex_t linklock;
+    struct inoset links;
+    pthread_mutex_t donelock;
+    pthread_cond_t finished; // signalled with donelock held once done is set
+    struct poolworker workers[DU_THREADS_MAX];
+};
+
+// the job whose progress is shown, owned by the main thread
+static struct dujob* dujob;
+
+/*
+ * Remembers the size of a directory.
+ */
+static void ducache_put(const struct dunode* d) {
+    pthread_mutex_lock(&ducache.lock);
+    if (ducache.count == DU_CACHE_MAX) {
+        inoset_free(&ducache.index);
+        inoset_free(&ducache.paths);
+        ducache.count = 0;
+    }
+    bool added;
+    dev_t dev;
+    ino_t ino;
+    namekey(d->path, &dev, &ino);
+    inoset_add(&ducache.paths, dev, ino, &added);
+    struct inoslot* s = inoset_add(&ducache.index, d->dev, d->ino, &added);
+    if (added) {
+        if (ducache.count == ducache.size) {
+            size_t size = ducache.size ? ducache.size * 2 : LIST_ALLOC_SIZE;
+            struct dusize* sizes = realloc(ducache.sizes, size * sizeof(*sizes));
+            if (!sizes) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            ducache.sizes = sizes;
+            ducache.size = size;
+        }
+        s->val = ducache.count++;
+    }
+    ducache.sizes[s->val] = (struct dusize){
+        d->mtime, atomic_load(&d->bytes), atomic_load(&d->files),
+    };
+    pthread_mutex_unlock(&ducache.lock);
+}
+
+/*
+ * Looks up the remembered size of a directory, if it hasn't changed since.
+ */
+static bool ducache_get(const struct stat* st, struct dusize* out) {
+    bool found = false;
+    pthread_mutex_lock(&ducache.lock);
+    struct inoslot* s = inoset_find(&ducache.index, st->st_dev, st->st_ino);
+    if (s) {
+        *out = ducache.sizes[s->val];
+        found = out->mtime.tv_sec == st->st_mtim.tv_sec
+            && out->mtime.tv_nsec == st->st_mtim.tv_nsec;
+    }
+    pthread_mutex_unlock(&ducache.lock);
+    return found;
+}
+
+static void du_release(struct dujob* j) {
+    if (atomic_fetch_sub(&j->refs, 1) != 1) {
+        return;
+    }
+    pool_destroy(&j->pool);
+    pthread_mutex_destroy(&j->linklock);
+    pthread_mutex_destroy(&j->donelock);
+    pthread_cond_destroy(&j->finished);
+    inoset_free(&j->links);
+    free(j);
+}
+
+static struct dunode* du_newnode(struct dunode* parent, const char* dir, const char* name, const struct stat* st) {
+    size_t dl = strlen(dir);
+    size_t nl = name ? strlen(name) + 1 : 0;
+    struct dunode* d = malloc(sizeof(*d) + dl + nl + 1);
+    if (!d) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    d->parent = parent;
+    atomic_init(&d->bytes, (int_fast64_t)st->st_blocks * 512);
+    atomic_init(&d->files, 0);
+    atomic_init(&d->pending, 1);
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    memcpy(d->path, dir, dl);
+    if (name) {
+        d->path[dl] = '/';
+        memcpy(d->path + dl + 1, name, nl - 1);
+    }
+    d->path[dl + nl] = '\0';
+    return d;
+}
+
+/*
+ * Marks one more part of a directory as done. Once all of it is, its total is
+ * cached and added to its parent, and so on up.
+ */
+static void du_finish(struct dujob* j, struct dunode* d) {
+    while (d && atomic_fetch_sub(&d->pending, 1) == 1) {
+        struct dunode* parent = d->parent;
+        if (!atomic_load(&j->cancelled)) {
+            ducache_put(d);
+        }
+        if (parent) {
+            atomic_fetch_add(&parent->bytes, atomic_load(&d->bytes));
+            atomic_fetch_add(&parent->files, atomic_load(&d->files));
+        } else {
+            atomic_store(&j->bytes, atomic_load(&d->bytes));
+            atomic_store(&j->files, atomic_load(&d->files));
+            pthread_mutex_lock(&j->donelock);
+            atomic_store(&j->done, true);
+            pthread_cond_broadcast(&j->finished);
+            pthread_mutex_unlock(&j->donelock);
+        }
+        free(d);
+        d = parent;
+    }
+}
+
+static void du_task(struct pool* p, size_t id, void* arg);
+
+/*
+ * Reads one directory, counting its files and queueing its subdirectories.
+ */
+static void du_read(struct dujob* j, size_t id, struct dunode* d) {
+    struct liststats stats = {0};
+    struct dirreader r;
+    const char* name;
+    unsigned char dtype;
+    struct stat st;
+
+    if (atomic_load(&j->cancelled)
+            || 0 != dr_openat(&r, AT_FDCWD, d->path, d->parent ? O_NOFOLLOW : 0, &stats)) {
+        return;
+    }
+    while (!atomic_load(&j->cancelled) && dr_next(&r, &name, &dtype)) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (0 != fstatat(r.fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev == j->dev) {
+                atomic_fetch_add(&d->pending, 1);
+                pool_push(&j->pool, id, du_task, du_newnode(d, d->path, name, &st));
+                atomic_fetch_add(&j->bytes, (int_fast64_t)st.st_blocks * 512);
+            }
+            continue;
+        }
+        if (st.st_nlink > 1) {
+            bool added;
+            pthread_mutex_lock(&j->linklock);
+            inoset_add(&j->links, st.st_dev, st.st_ino, &added);
+            pthread_mutex_unlock(&j->linklock);
+            if (!added) {
+                continue;
+            }
+        }
+        atomic_fetch_add(&d->bytes, (int_fast64_t)st.st_blocks * 512);
+        atomic_fetch_add(&d->files, 1);
+        atomic_fetch_add(&j->bytes, (int_fast64_t)st.st_blocks * 512);
+        atomic_fetch_add(&j->files, 1);
+    }
+    dr_close(&r);
+}
+
+/*
+ * Reads a directory, and finishes it if it has no subdirectories.
+ */
+static void du_task(struct pool* p, size_t id, void* arg) {
+    struct dujob* j = (struct dujob*)p;
+    du_read(j, id, arg);
+    du_finish(j, arg);
+}
+
+/*
+ * Body of each worker thread, which holds a reference to the job until
+ * there's nothing left to do.
+ */
+static void* du_thread(void* arg) {
+    struct poolworker* w = arg;
+    struct dujob* j = (struct dujob*)w->pool;
+    pool_work(w->pool, w->id);
+    du_release(j);
+    return NULL;
+}
+
+/*
+ * Starts computing the size of a directory in the background, cancelling the
+ * one being computed before. Returns false if it couldn't be started.
+ */
+static bool du_start(const char* path) {
+    struct stat st;
+
+    if (dujob) {
+        atomic_store(&dujob->cancelled, true);
+        du_release(dujob);
+        dujob = NULL;
+    }
+    if (0 != stat(path, &st)) {
+        return false;
+    }
+
+    struct dujob* j = calloc(1, sizeof(*j));
+    if (!j) {
+        return false;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_init(&j->pool, (cpus < 2) ? 2 : (cpus > DU_THREADS_MAX) ? DU_THREADS_MAX : (size_t)cpus);
+    j->dev = st.st_dev;
+    memcpy(j->root, path, strnlen(path, PATH_MAX));
+    pthread_mutex_init(&j->linklock, NULL);
+    pthread_mutex_init(&j->donelock, NULL);
+    pthread_cond_init(&j->finished, NULL);
+    atomic_init(&j->refs, 1);
+    atomic_init(&j->bytes, (int_fast64_t)st.st_blocks * 512);
+    pool_push(&j->pool, 0, du_task, du_newnode(NULL, path, NULL, &st));
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    size_t started = 0;
+    for (size_t i = 0; i < j->pool.nqueues; i++) {
+        j->workers[i] = (struct poolworker){ &j->pool, i };
+        atomic_fetch_add(&j->refs, 1);
+        if (0 != pthread_create(&(pthread_t){0}, &attr, du_thread, &j->workers[i])) {
+            atomic_fetch_sub(&j->refs, 1);
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (!started) {
+        // nobody can take the root off the queue, so walk it here
+        atomic_fetch_add(&j->refs, 1);
+        du_thread(&j->workers[0]);
+    }
+    dujob = j;
+    return true;
+}
+
+/*
+ * Returns whether the size of a directory is still being computed.
+ */
+static bool du_running(void) {
+    return dujob && !atomic_load(&dujob->done) && !atomic_load(&dujob->cancelled);
+}
+
+/*
+ * Waits for the size being computed to be final.
+ */
+static void du_wait(void) {
+    pthread_mutex_lock(&dujob->donelock);
+    while (!atomic_load(&dujob->done)) {
+        pthread_cond_wait(&dujob->finished, &dujob->donelock);
+    }
+    pthread_mutex_unlock(&dujob->donelock);
+}
+
+/*
+ * Gets the size of the directory name in dir, open as dfd, from the job
+ * computing it or from the cache. Sets running if it isn't final yet.
+ * It's only stat'd if a size was remembered for its path, so that moving
+ * over directories doesn't touch them.
+ */
+static bool du_get(int dfd, const char* dir, const char* name, struct dusize* out, bool* running) {
+    char path[PATH_MAX+1];
+    struct stat st;
+    dev_t dev;
+    ino_t ino;
+
+    *running = false;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+        return false;
+    }
+    if (dujob && 0 == strcmp(dujob->root, path)) {
+        *running = !atomic_load(&dujob->done);
+        out->bytes = atomic_load(&dujob->bytes);
+        out->files = atomic_load(&dujob->files);
+        return true;
+    }
+
+    namekey(path, &dev, &ino);
+    pthread_mutex_lock(&ducache.lock);
+    bool known = inoset_find(&ducache.paths, dev, ino) != NULL;
+    pthread_mutex_unlock(&ducache.lock);
+    return known && dfd >= 0 && 0 == fstatat(dfd, name, &st, 0) && ducache_get(&st, out);
+}
+
+/*
+ * Formats a size like du -h does.
+ */
+static void humansize(char* out, size_t size, int64_t bytes) {
+    static const char units[] = "BKMGTPE";
+    double n = (double)bytes;
+    int u = 0;
+    // anything which would round up to 1024 goes on to the next unit
+    while (n >= 1023.5 && units[u+1]) {
+        n /= 1024;
+        u++;
+    }
+    if (u == 0 || n >= 10) {
+        snprintf(out, size, "%.0f%c", n, units[u]);
+    } else {
+        snprintf(out, size, "%.1f%c", n, units[u]);
+    }
+}
+
+/*
+ * Background jobs. Pastes, deletions, cuts and undos are queued and done one
+ * after another on a thread of their own, so that cfm can still be used while
+ * they run. Finished jobs are handed back to the main loop, which does the
+ * bookkeeping for them (the undo stack, the index, and what was cut), so
+ * none of that is shared. While a job runs, what it's working on is counted
+ * on another thread, to show how far along it is.
+ *
+ * A copy can be cancelled at any point, after which whatever it had made is
+ * removed. Once the copy for a move has finished, the move can't be
+ * cancelled, so that the original isn't left half deleted.
+ */
+enum jobkind {
+    JOB_PASTE, // copies src to dst
+    JOB_TRASH, // moves src to dst in the trash, to be undone
+    JOB_CUT, // moves src to dst in the trash, to be pasted
+    JOB_DELETE, // deletes src for good
+    JOB_UNDO, // moves src in the trash back to dst
+};
+
+static const char* jobverbs[] = { "Pasting", "Deleting", "Cutting", "Deleting", "Undoing" };
+
+struct job {
+    enum jobkind kind;
+    int err; // 0 if it worked
+    struct deletedfile* deleted; // for moving to and from the trash
+    char msg[128]; // for a paste, what was pasted
+    char src[PATH_MAX+1];
+    char dst[PATH_MAX+1];
+    struct job* next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle; // signalled when the queue runs dry
+    struct job* queue; // waiting, oldest first
+    struct job* running;
+    struct job* done; // newest first, for the main loop
+    size_t waiting;
+    bool thread; // whether the worker is running
+    bool cancellable; // whether cancelling the running job may stop it
+    // progress of the running job
+    bool removing; // whether it's onto deleting
+    long long started; // ms
+    atomic_bool counting;
+    atomic_bool counted;
+    atomic_size_t files;
+    atomic_int_fast64_t bytes;
+} jobs = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+// pipe used by the worker to wake up the main loop when a job is done
+static int jobwake[2] = { -1, -1 };
+
+/*
+ * Adds up the files in path and the bytes in them, for as long as the job
+ * they're for is running.
+ */
+static void job_count(const char* path) {
+    struct liststats stats = {0};
+    struct treewalk w;
+    struct dirreader r;
+    const char* e;
+    unsigned char type;
+    struct stat st;
+    bool scan = true;
+
+    if (0 != lstat(path, &st)) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        atomic_fetch_add(&jobs.files, 1);
+        atomic_fetch_add(&jobs.bytes, S_ISREG(st.st_mode) ? st.st_size : 0);
+        return;
+    }
+    if (0 != tw_start(&w, AT_FDCWD, path, NULL)) {
+        return;
+    }
+    while (w.depth && atomic_load(&jobs.counting)) {
+        if (scan && 0 == dr_openat(&r, w.fd, ".", 0, &stats)) {
+            while (atomic_load(&jobs.counting) && dr_next(&r, &e, &type)) {
+                if (0 == strcmp(e, ".") || 0 == strcmp(e, "..")
+                        || 0 != fstatat(r.fd, e, &st, AT_SYMLINK_NOFOLLOW)) {
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    tw_push(&w, e);
+                } else {
+                    atomic_fetch_add(&jobs.files, 1);
+                    atomic_fetch_add(&jobs.bytes, S_ISREG(st.st_mode) ? st.st_size : 0);
+                }
+            }
+            dr_close(&r);
+        }
+        scan = false;
+
+        if (tw_next(&w)) {
+            if (0 == tw_down(&w)) {
+                scan = true;
+            } else {
+                tw_drop(&w);
+            }
+        } else if (0 != tw_up(&w)) {
+            break;
+        } else if (w.depth) {
+            tw_drop(&w);
+        }
+    }
+    tw_end(&w);
+}
+
+static void* job_counter(void* arg) {
+    job_count(arg);
+    atomic_store(&jobs.counted, true);
+    return NULL;
+}
+
+/*
+ * Describes what the last copy did.
+ */
+static void copysummary(char* out, size_t size) {
+    char n[16];
+    size_t files = atomic_load(&copystats.files);
+    humansize(n, sizeof(n), atomic_load(&copystats.bytes));
+    int len = snprintf(out, size, "%zu file%s, %s", files, (files == 1) ? "" : "s", n);
+    if (atomic_load(&copystats.skipped) && len < (int)size) {
+        humansize(n, sizeof(n), atomic_load(&copystats.skipped));
+        len += snprintf(out + len, size - len, " (%s of holes skipped)", n);
+    }
+    size_t links = atomic_load(&copystats.links);
+    if (links && len < (int)size) {
+        snprintf(out + len, size - len, " (%zu hard link%s kept)", links, (links == 1) ? "" : "s");
+    }
+}
+
+/*
+ * Moves the running job on to deleting. For a move, it can't be cancelled
+ * from then on, and this returns whether it was cancelled before that.
+ */
+static bool job_commit(bool move) {
+    pthread_mutex_lock(&jobs.lock);
+    bool c = move && atomic_load(&copystats.cancel);
+    jobs.cancellable = !move;
+    jobs.removing = true;
+    pthread_mutex_unlock(&jobs.lock);
+    return c;
+}
+
+static void job_run(struct job* j) {
+    pthread_t counter;
+    bool failed = false, cancel = false;
+
+    // moving in and out of the trash is only a rename unless it's on
+    // another filesystem
+    if (j->kind != JOB_PASTE && j->kind != JOB_DELETE) {
+        if (0 == movefile(j->src, j->dst)) {
+            return;
+        } else if (errno != EXDEV) {
+            j->err = errno;
+            return;
+        }
+    }
+
+    atomic_store(&jobs.counted, false);
+    atomic_store(&jobs.files, 0);
+    atomic_store(&jobs.bytes, 0);
+    atomic_store(&jobs.counting, true);
+    atomic_store(&copystats.files, 0);
+    atomic_store(&copystats.bytes, 0);
+    atomic_store(&copystats.removed, 0);
+    bool counting = 0 == pthread_create(&counter, NULL, job_counter, j->src);
+
+    errno = 0;
+    if (j->kind == JOB_DELETE) {
+        job_commit(false);
+        failed = 0 != del(j->src);
+    } else if (0 != cpfile(j->src, j->dst) || (j->kind != JOB_PASTE && job_commit(true))) {
+        failed = true;
+        cancel = atomic_load(&copystats.cancel);
+        // a paste which failed part of the way through keeps what it could
+        // copy, but there's no use for anything else which didn't finish
+        if ((cancel || j->kind != JOB_PASTE) && atomic_load(&copystats.top)) {
+            int e = errno;
+            atomic_store(&copystats.cancel, false);
+            del(j->dst);
+            errno = e;
+        }
+    } else if (j->kind == JOB_PASTE) {
+        copysummary(j->msg, sizeof(j->msg));
+    } else {
+        failed = 0 != del(j->src);
+    }
+    if (failed) {
+        j->err = (cancel || atomic_load(&copystats.cancel)) ? ECANCELED : errno ? errno : EIO;
+    }
+
+    atomic_store(&jobs.counting, false);
+    if (counting) {
+        pthread_join(counter, NULL);
+    }
+}
+
+static void* job_thread(void* UNUSED(arg)) {
+    pthread_mutex_lock(&jobs.lock);
+    while (jobs.queue) {
+        struct job* j = jobs.queue;
+        jobs.queue = j->next;
+        jobs.waiting--;
+        jobs.running = j;
+        jobs.cancellable = true;
+        jobs.removing = false;
+        jobs.started = msnow();
+        atomic_store(&copystats.cancel, false);
+        pthread_mutex_unlock(&jobs.lock);
+
+        job_run(j);
+
+        pthread_mutex_lock(&jobs.lock);
+        jobs.running = NULL;
+        j->next = jobs.done;
+        jobs.done = j;
+        char c = 0;
+        (void)!write(jobwake[1], &c, 1);
+    }
+    jobs.thread = false;
+    pthread_cond_broadcast(&jobs.idle);
+    pthread_mutex_unlock(&jobs.lock);
+    copybuf_free();
+    return NULL;
+}
+
+/*
+ * Queues a job, starting the worker if it isn't running. When not
+ * interactive, the job is done right away instead.
+ */
+static void job_push(enum jobkind kind, const char* src, const char* dst, struct deletedfile* deleted) {
+    if (jobwake[0] < 0) {
+        if (0 != pipe(jobwake)) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < 2; i++) {
+            fcntl(jobwake[i], F_SETFL, O_NONBLOCK);
+            fcntl(jobwake[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    struct job* j = calloc(1, sizeof(*j));
+    if (!j) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    j->kind = kind;
+    j->deleted = deleted;
+    snprintf(j->src, sizeof(j->src), "%s", src);
+    snprintf(j->dst, sizeof(j->dst), "%s", dst ? dst : "");
+
+    pthread_mutex_lock(&jobs.lock);
+    struct job** p = &jobs.queue;
+    while (*p) {
+        p = &(*p)->next;
+    }
+    *p = j;
+    jobs.waiting++;
+    bool start = !jobs.thread;
+    jobs.thread = true;
+    pthread_mutex_unlock(&jobs.lock);
+
+    if (start) {
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (!interactive || 0 != pthread_create(&t, &attr, job_thread, NULL)) {
+            job_thread(NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/*
+ * Takes the jobs which have finished, oldest first. Each is freed with
+ * job_next() once it's been dealt with.
+ */
+static struct job* job_collect(void) {
+    char buf[64];
+    if (jobwake[0] >= 0) {
+        while (read(jobwake[0], buf, sizeof(buf)) > 0);
+    }
+
+    pthread_mutex_lock(&jobs.lock);
+    struct job* done = jobs.done;
+    jobs.done = NULL;
+    pthread_mutex_unlock(&jobs.lock);
+
+    struct job* list = NULL;
+    while (done) {
+        struct job* next = done->next;
+        done->next = list;
+        list = done;
+        done = next;
+    }
+    return list;
+}
+
+static struct job* job_next(struct job* j) {
+    struct job* next = j->next;
+    free(j);
+    return next;
+}
+
+/*
+ * Returns how many jobs are running or waiting.
+ */
+static size_t job_pending(void) {
+    pthread_mutex_lock(&jobs.lock);
+    size_t n = jobs.waiting + (jobs.running != NULL);
+    pthread_mutex_unlock(&jobs.lock);
+    return n;
+}
+
+/*
+ * Cancels the running job, if it can still be. Returns whether it could.
+ */
+static bool job_cancel(void) {
+    pthread_mutex_lock(&jobs.lock);
+    bool c = jobs.running && jobs.cancellable;
+    if (c) {
+        atomic_store(&copystats.cancel, true);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return c;
+}
+
+/*
+ * Drops the jobs which haven't started and waits for the running one, which
+ * is cancelled if it can be. Used when quitting. Undos are left to finish,
+ * since the trash goes away when cfm exits.
+ */
+static void job_stopall(void) {
+    pthread_mutex_lock(&jobs.lock);
+    struct job** p = &jobs.queue;
+    while (*p) {
+        struct job* j = *p;
+        if (j->kind == JOB_UNDO) {
+            p = &j->next;
+        } else {
+            *p = j->next;
+            jobs.waiting--;
+            free(j);
+        }
+    }
+    if (jobs.running && jobs.running->kind != JOB_UNDO && jobs.cancellable) {
+        atomic_store(&copystats.cancel, true);
+    }
+    while (jobs.thread) {
+        pthread_cond_wait(&jobs.idle, &jobs.lock);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+static void humantime(char* out, size_t size, long long secs) {
+    if (secs >= 3600) {
+        snprintf(out, size, "%lldh%02lldm", secs / 3600, secs / 60 % 60);
+    } else if (secs >= 60) {
+        snprintf(out, size, "%lldm%02llds", secs / 60, secs % 60);
+    } else {
+        snprintf(out, size, "%llds", secs);
+    }
+}
+
+/*
+ * Describes how far the running job has got, and how many are waiting.
+ * Returns false if there are none.
+ */
+static bool job_progress(char* out, size_t size) {
+    char name[NAME_MAX+1];
+    char done[16], total[16], rate[16], left[48];
+
+    pthread_mutex_lock(&jobs.lock);
+    struct job* j = jobs.running;
+    size_t waiting = jobs.waiting;
+    bool removing = jobs.removing;
+    long long ms = msnow() - jobs.started;
+    enum jobkind kind = j ? j->kind : JOB_PASTE;
+    if (j) {
+        const char* b = basename((kind == JOB_UNDO) ? j->dst : j->src);
+        snprintf(name, sizeof(name), "%.*s", NAME_MAX, b ? b : j->src);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+
+    if (!j && !waiting) {
+        return false;
+    }
+    if (!j) {
+        snprintf(out, size, "%zu job%s waiting", waiting, (waiting == 1) ? "" : "s");
+        return true;
+    }
+
+    bool counted = atomic_load(&jobs.counted);
+    int len;
+    int64_t secs = -1;
+    if (removing) {
+        // only files are counted, so that's how deleting is measured
+        size_t n = atomic_load(&copystats.removed);
+        size_t of = atomic_load(&jobs.files);
+        len = snprintf(out, size, "%s %s: %zu", jobverbs[kind], name, n);
+        if (counted) {
+            len += snprintf(out + len, size - len, " of %zu", of);
+        }
+        len += snprintf(out + len, size - len, " files");
+        if (counted && n && ms > 0 && of > n) {
+            secs = (int64_t)(of - n) * ms / n / 1000;
+        }
+    } else {
+        int64_t n = atomic_load(&copystats.bytes);
+        int64_t of = atomic_load(&jobs.bytes);
+        humansize(done, sizeof(done), n);
+        humansize(rate, sizeof(rate), (ms > 0) ? n * 1000 / ms : 0);
+        len = snprintf(out, size, "%s %s: %s", jobverbs[kind], name, done);
+        if (counted) {
+            humansize(total, sizeof(total), of);
+            len += snprintf(out + len, size - len, " of %s", total);
+        }
+        len += snprintf(out + len, size - len, ", %s/s", rate);
+        if (counted && n > 0 && ms > 0 && of > n) {
+            secs = (of - n) * ms / n / 1000;
+        }
+    }
+    if (secs >= 0 && len < (int)size) {
+        humantime(left, sizeof(left), secs);
+        len += snprintf(out + len, size - len, ", %s left", left);
+    }
+    if (waiting && len < (int)size) {
+        snprintf(out + len, size - len, ", %zu more waiting", waiting);
+    }
+    return true;
+}
+
+/*
+ * Finishes classifying an entry whose type is pending.
+ */
+static void resolve(struct listelem* e) {
+    struct stat st;
+
+    // the directory is only held open once it's been read
+    if (!e->pending || shown->fd < 0) {
+        return;
+    }
+    e->pending = false;
+
+    shown->stats.stats++;
+    if (0 == fstatat(shown->fd, entryname(shown->names.buf + e->name), &st, AT_SYMLINK_NOFOLLOW)
+            && (st.st_mode & S_IXUSR)) {
+        e->type = ELEM_EXEC;
+    }
+}
+
+/*
+ * Resolves the pending entries in the range [from, to). If map is set, the
+ * range is of the entries it points to.
+ */
+static void resolverange(struct listelem* l, const uint32_t* map, size_t n, size_t from, size_t to) {
+    if (!interactive) return;
+    for (size_t i = from; i < to && i < n; i++) {
+        resolve(&(l[map ? map[i] : i]));
+    }
+}
+
+/*
+ * Finds an entry in a sorted listing, matching both its name and whether or
+ * not it is a directory. Info is the entry's size and time, which is needed
+ * if the listing is sorted by them. Stores its index in pos if it is found,
+ * else stores the index where it should be inserted.
+ * Returns true if the entry was found.
+ */
+static bool findelem(const struct listing* ls, bool dir, const char* name, const struct entryinfo* info, size_t* pos) {
+    char e[ENTRY_MAX];
+    makeentry(e, dir, name);
+
+    size_t lo = 0, hi = ls->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct listelem* m = &ls->list[mid];
+        if (sortcmp(ls->mode, ls->names.buf + m->name, ls->info ? &ls->info[m->id] : NULL, e, info) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+
+    return lo < ls->count && 0 == entrycmp(ls->names.buf + ls->list[lo].name, e);
+}
+
+// values in a listing's ids other than the ids themselves
+#define ID_NONE UINT32_MAX // the entry with the name was removed
+#define ID_SHARED (UINT32_MAX - 1) // more than one name has had the key
+
+/*
+ * Adds an entry's id to its listing's ids. A key which another entry's name
+ * already has is marked as shared, so that findname() doesn't use it to
+ * look for either of them.
+ */
+static void ids_add(struct listing* ls, const char* name, uint32_t id) {
+    bool added;
+    dev_t dev;
+    ino_t ino;
+    namekey(name, &dev, &ino);
+    struct inoslot* s = inoset_add(&ls->ids, dev, ino, &added);
+    // a removed entry's id is taken out, so any other is a live entry's
+    s->val = (added || s->val == ID_NONE) ? id : ID_SHARED;
+}
+
+/*
+ * Takes a removed entry's id out of its listing's ids.
+ */
+static void ids_remove(struct listing* ls, const char* name, uint32_t id) {
+    dev_t dev;
+    ino_t ino;
+    namekey(name, &dev, &ino);
+    struct inoslot* s = inoset_find(&ls->ids, dev, ino);
+    if (s && s->val == id) {
+        s->val = ID_NONE;
+    }
+}
+
+/*
+ * Finds an entry in a sorted listing by name alone.
+ * Returns the index of the entry, or the number of entries if it isn't there.
+ */
+static size_t findname(struct listing* ls, const char* name) {
+    const struct entryinfo* info = NULL;
+    size_t i;
+
+    if (SORT_NEEDS_INFO(ls->mode)) {
+        // where it is depends on its size or time when it was last seen, so
+        // look up its id to find those. The ids are only gathered once they
+        // are needed, and then kept up to date by patch_insert() and
+        // patch_remove()
+        dev_t dev;
+        ino_t ino;
+        if (!ls->ids.count) {
+            for (i = 0; i < ls->count; i++) {
+                ids_add(ls, nameof(ls, i), ls->list[i].id);
+            }
+        }
+        namekey(name, &dev, &ino);
+        struct inoslot* s = inoset_find(&ls->ids, dev, ino);
+        if (!s || s->val == ID_NONE) {
+            return ls->count;
+        }
+        if (s->val == ID_SHARED) {
+            for (i = 0; i < ls->count && 0 != strcmp(nameof(ls, i), name); i++);
+            return i;
+        }
+        info = &ls->info[s->val];
+    }
+
+    if (findelem(ls, true, name, info, &i) || findelem(ls, false, name, info, &i)) {
+        return i;
+    }
+    return ls->count;
+}
+
+/*
+ * Returns whether a name starts with prefix, ignoring case if fold is set.
+ */
+static bool hasprefix(const char* name, const char* prefix, size_t len, bool fold) {
+    if (!fold) {
+        return 0 == strncmp(name, prefix, len);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)name[i]) != (unsigned char)prefix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Finds the first entry shown by a view whose name starts with prefix,
+ * ignoring case unless the prefix has capitals.
+ * When sorted by name, entries whose keys start with the prefix's key are
+ * next to each other, so the first is found with a binary search for each of
+ * directories and files. That is the answer unless the prefix has capitals or
+ * digits, which the key doesn't tell apart, in which case the entries with
+ * that key are looked through in order. A prefix ending in digits is looked
+ * for without them, since "f1" has to find "f10", whose key is for 10.
+ * Returns the index of the entry, or the number of entries shown if there is
+ * none.
+ */
+static size_t findprefix(const struct view* v, const char* prefix) {
+    const struct listing* ls = v->ls;
+    size_t len = strlen(prefix);
+    bool fold = true;
+
+    for (size_t i = 0; i < len; i++) {
+        if (isupper((unsigned char)prefix[i])) {
+            fold = false;
+        }
+    }
+
+    // a listing which is still loading isn't sorted yet
+    if (ls->mode != SORT_NAME || !ls->complete || v->filter.len) {
+        size_t i;
+        for (i = 0; i < viewcount(v) && !hasprefix(nameat(v, i), prefix, len, fold); i++);
+        return i;
+    }
+
+    char p[NAME_MAX+1];
+    size_t base = len;
+    while (base > 0 && isdigit((unsigned char)prefix[base-1])) {
+        base--;
+    }
+    memcpy(p, prefix, base);
+    p[base] = '\0';
+
+    for (int dir = 1; dir >= 0; dir--) {
+        char e[ENTRY_MAX];
+        makeentry(e, dir, p);
+        const char* k = e + 2;
+        size_t kl = keylen(e);
+
+        // the first entry whose key doesn't sort before k
+        size_t lo = 0, hi = ls->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            char* m = ls->names.buf + ls->list[mid].name;
+            size_t ml = keylen(m);
+            int c = memcmp(m + 2, k, (ml < kl) ? ml : kl);
+            if (c < 0 || (c == 0 && ml < kl)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        for (size_t i = lo; i < ls->count; i++) {
+            char* m = ls->names.buf + ls->list[i].name;
+            if (keylen(m) < kl || 0 != memcmp(m + 2, k, kl)) {
+                break;
+            }
+            if (hasprefix(entryname(m), prefix, len, fold)) {
+                return i;
+            }
+        }
+    }
+
+    return ls->count;
+}
+
+/*
+ * Rebuilds the names and info of a listing without the ones left behind by
+ * removed entries.
  */
-static int termsize(void) {
-    if (!interactive) return 0;
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0) {
-        perror("ioctl");
-        return 1;
+static void listing_compact(struct listing* ls) {
+    struct names n = {0};
+    struct entryinfo* info = NULL;
+    size_t infosize = 0;
+
+    grownames(&n, ls->names.len - ls->garbage);
+    if (ls->info) {
+        growinfo(&info, &infosize, ls->count);
     }
-
-    rows = ws.ws_row;
-    cols = ws.ws_col;
-
-    return 0;
+    for (size_t i = 0; i < ls->count; i++) {
+        char* e = ls->names.buf + ls->list[i].name;
+        size_t l = entrysize(e);
+        memcpy(n.buf + n.len, e, l);
+        ls->list[i].name = n.len;
+        n.len += l;
+        if (info) {
+            info[i] = ls->info[ls->list[i].id];
+        }
+        ls->list[i].id = (uint32_t)i;
+    }
+    free(ls->names.buf);
+    ls->names = n;
+    ls->garbage = 0;
+    free(ls->info);
+    ls->info = info;
+    ls->infosize = infosize;
+    ls->nextid = (uint32_t)ls->count;
+    inoset_free(&ls->ids);
 }
 
 /*
- * Sets up the terminal for TUI.
- * Return 0 on success.
+ * Sorts a complete listing by another mode, keeping the selection of each
+ * view showing it on the same file.
+ * Returns false if the listing doesn't have what's needed to sort it that
+ * way, in which case it has to be read again.
  */
-static int setupterm(void) {
-    if (!interactive) return 0;
+static bool listing_sort(struct listing* ls, enum sortmode mode, struct view* views, int n) {
+    if (SORT_NEEDS_INFO(mode) && !ls->info) {
+        return false;
+    }
 
-    setvbuf(stdout, NULL, _IOFBF, 0);
+    uint32_t ids[VIEW_COUNT];
+    for (int v = 0; v < n; v++) {
+        if (views[v].ls == ls && views[v].selection < viewcount(&views[v])) {
+            ids[v] = elemat(&views[v], views[v].selection)->id;
+        }
+    }
 
-    struct termios new_term = old_term;
-    new_term.c_oflag &= ~OPOST;
-    new_term.c_lflag &= ~(ECHO | ICANON);
+    ls->mode = mode;
+    sortlist(ls->list, ls->count, ls->names.buf, ls->info, mode);
 
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &new_term) < 0) {
-        perror("tcsetattr");
-        return 1;
+    for (int v = 0; v < n; v++) {
+        if (views[v].ls != ls) {
+            continue;
+        }
+        if (views[v].selection >= viewcount(&views[v])) {
+            if (views[v].filter.len) {
+                filter_run(&views[v], false, ls->count);
+            }
+            continue;
+        }
+        size_t i;
+        for (i = 0; i < ls->count && ls->list[i].id != ids[v]; i++);
+        if (views[v].filter.len) {
+            // the results are in listing order, so they have to be redone
+            filter_run(&views[v], false, i);
+            continue;
+        }
+        view_select(&views[v], i);
     }
 
-    printf(
-            "\033[?1049h" // use alternative screen buffer
-            "\033[?7l"    // disable line wrapping
-            "\033[?25l"   // hide cursor
-            "\033[2J"     // clear screen
-            "\033[2;%dr", // limit scrolling to our rows
-            rows-1);
-
-    return 0;
+    return true;
 }
 
 /*
- * Resets the terminal to how it was before we ruined it.
+ * Removes an element from a listing, keeping the selection of each view
+ * showing it on the same file where possible.
  */
-static void resetterm(void) {
-    if (!interactive) return;
-
-    setvbuf(stdout, NULL, _IOLBF, 0);
-
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term) < 0) {
-        perror("tcsetattr");
-        return;
+static void patch_remove(struct listing* ls, size_t i, struct view* views, int n) {
+    if (ls->list[i].marked) {
+        ls->marks--;
+    }
+    ls->garbage += entrysize(ls->names.buf + ls->list[i].name);
+    if (ls->ids.count) {
+        ids_remove(ls, nameof(ls, i), ls->list[i].id);
     }
 
-    printf(
-            "\033[?7h"    // enable line wrapping
-            "\033[?25h"   // unhide cursor
-            "\033[r"     // reset scroll region
-            "\033[?1049l" // restore main screen
-          );
+    memmove(&ls->list[i], &ls->list[i+1], (ls->count - i - 1) * sizeof(*ls->list));
+    ls->count--;
 
-    fflush(stdout);
+    for (int v = 0; v < n; v++) {
+        if (views[v].ls != ls) {
+            continue;
+        }
+        // where it was in what the view shows
+        size_t j = i;
+        struct filter* f = &views[v].filter;
+        if (f->len) {
+            j = filter_find(f, i);
+            bool visible = j < f->count && f->idx[j] == i;
+            if (visible) {
+                memmove(&f->idx[j], &f->idx[j+1], (f->count - j - 1) * sizeof(*f->idx));
+                f->count--;
+            }
+            for (size_t x = j; x < f->count; x++) {
+                f->idx[x]--;
+            }
+            if (!visible) {
+                continue;
+            }
+        }
+        size_t* sel = &views[v].selection;
+        size_t* pos = &views[v].pos;
+        if (j < *sel) {
+            (*sel)--;
+            if (j >= *sel + 1 - *pos && *pos > 0) {
+                (*pos)--;
+            }
+        } else if (*sel >= viewcount(&views[v]) && *sel > 0) {
+            (*sel)--;
+            if (*pos > 0) {
+                (*pos)--;
+            }
+        }
+    }
 }
 
 /*
- * Creates a child process.
+ * Inserts an entry into a listing in sorted order, keeping the selection
+ * of each view showing it on the same file.
  */
-static void execcmd(const char* path, const char* cmd, const char* arg) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        return;
+static void patch_insert(struct listing* ls, const char* name, enum elemtype type, const struct entryinfo* info, bool marked, struct view* views, int n) {
+    size_t i;
+    findelem(ls, E_DIR(type), name, info, &i);
+
+    if (ls->info) {
+        growinfo(&ls->info, &ls->infosize, ls->nextid + 1);
+        ls->info[ls->nextid] = *info;
     }
 
-    resetterm();
+    growlist(&ls->list, &ls->listsize, ls->count + 1);
+    memmove(&ls->list[i+1], &ls->list[i], (ls->count - i) * sizeof(*ls->list));
+    ls->list[i] = (struct listelem){
+        .name = addname(&ls->names, E_DIR(type), name),
+        .id = ls->nextid++,
+        .type = type,
+        .marked = marked,
+    };
+    ls->count++;
 
-    if (pid == 0) {
-        if (chdir(path) < 0) {
-            _exit(EXIT_FAILURE);
-        }
-        execlp(cmd, cmd, arg, NULL);
-        _exit(EXIT_FAILURE);
-    } else {
-        int s;
-        do {
-            waitpid(pid, &s, WUNTRACED);
-        } while (!WIFEXITED(s) && !WIFSIGNALED(s));
+    if (ls->ids.count) {
+        ids_add(ls, name, ls->list[i].id);
     }
 
-    setupterm();
-    fflush(stdout);
+    if (marked) {
+        ls->marks++;
+    }
+
+    for (int v = 0; v < n; v++) {
+        if (views[v].ls != ls) {
+            continue;
+        }
+        // where it goes in what the view shows
+        size_t j = i;
+        struct filter* f = &views[v].filter;
+        if (f->len) {
+            j = filter_find(f, i);
+            for (size_t x = j; x < f->count; x++) {
+                f->idx[x]++;
+            }
+            if (!filter_match(f, nameof(ls, i), ls->names.buf + ls->names.len)) {
+                continue;
+            }
+            if (f->count == f->size) {
+                size_t size = f->size ? f->size * 2 : LIST_ALLOC_SIZE;
+                uint32_t* idx = realloc(f->idx, size * sizeof(*idx));
+                if (!idx) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                f->idx = idx;
+                f->size = size;
+            }
+            memmove(&f->idx[j+1], &f->idx[j], (f->count - j) * sizeof(*f->idx));
+            f->idx[j] = (uint32_t)i;
+            f->count++;
+        }
+        size_t* sel = &views[v].selection;
+        size_t* pos = &views[v].pos;
+        if (viewcount(&views[v]) > 1 && j <= *sel) {
+            if (j >= *sel - *pos && (int)*pos < rows - 3) {
+                (*pos)++;
+            }
+            (*sel)++;
+        }
+    }
 }
 
 /*
- * Reads a directory into the list, returning the number of items in the dir.
- * This will return 0 on success.
- * On failure, 'opendir' will have set 'errno'.
+ * Applies the changes reported by the watches to the listings of the views.
+ * Listings which can't be patched are marked stale.
+ * Returns true if anything changed.
  */
-static int listdir(const char* path, struct listelem** list, size_t* listsize, size_t* rcount, bool hidden) {
-    DIR* d;
-    struct dirent* dir;
-    d = opendir(path);
-    size_t count = 0;
-    struct stat st;
-    if (d) {
-        int dfd = dirfd(d);
-        while ((dir = readdir(d)) != NULL) {
-            if (dir->d_name[0] == '.' && (dir->d_name[1] == '\0' || (dir->d_name[1] == '.' && dir->d_name[2] == '\0'))) {
+static bool watch_apply(struct view* views, int n) {
+    bool changed = false;
+#ifdef __linux__
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    struct liststats stats = {0};
+
+    while ((len = read(inofd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // no telling what was missed
+                for (int v = 0; v < n; v++) {
+                    views[v].ls->stale = true;
+                }
+                changed = true;
                 continue;
             }
 
-            if (!hidden && dir->d_name[0] == '.') {
+            struct listing* ls = NULL;
+            for (int v = 0; v < n && !ls; v++) {
+                if (views[v].ls->watch == ev->wd && ev->wd >= 0) {
+                    ls = views[v].ls;
+                }
+            }
+            if (!ls || ls->stale) {
                 continue;
             }
 
-            if (count == *listsize) {
-                *listsize += LIST_ALLOC_SIZE;
-                *list = realloc(*list, *listsize * sizeof(**list));
-                if (*list == NULL) {
-                    perror("realloc");
-                    exit(EXIT_FAILURE);
-                }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                ls->stale = true;
+                changed = true;
+                continue;
             }
 
-            strncpy((*list)[count].name, dir->d_name, NAME_MAX);
-
-            (*list)[count].marked = false;
-
-            if (0 != fstatat(dfd, dir->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            if (!ev->len || (!ls->hidden && ev->name[0] == '.')) {
                 continue;
             }
 
-            if (S_ISDIR(st.st_mode)) {
-                (*list)[count].type = ELEM_DIR;
-            } else if (S_ISLNK(st.st_mode)) {
-                if (0 == fstatat(dfd, dir->d_name, &st, 0)) {
-                    if (S_ISDIR(st.st_mode)) {
-                        (*list)[count].type = ELEM_DIRLINK;
-                    } else {
-                        (*list)[count].type = ELEM_LINK;
+            ls->patched = true;
+            changed = true;
+
+            size_t i = findname(ls, ev->name);
+            enum elemtype type;
+            struct entryinfo info;
+            if (!(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                    && 0 == classify(ls->fd, ev->name, DT_UNKNOWN, &type, false, ls->info ? &info : NULL, &stats)) {
+                bool marked = false;
+                if (i < ls->count) {
+                    struct listelem* e = &ls->list[i];
+                    if (E_DIR(e->type) == E_DIR(type) && (!ls->info
+                                || 0 == memcmp(&ls->info[e->id], &info, sizeof(info)))) {
+                        // still sorts the same, so just update it in place
+                        e->type = type;
+                        e->pending = false;
+                        continue;
                     }
-                } else {
-                    (*list)[count].type = ELEM_LINK;
-                }
-            } else {
-                if (st.st_mode & S_IXUSR) {
-                    (*list)[count].type = ELEM_EXEC;
-                } else {
-                    (*list)[count].type = ELEM_FILE;
+                    marked = e->marked;
+                    patch_remove(ls, i, views, n);
                 }
+                patch_insert(ls, ev->name, type, &info, marked, views, n);
+            } else if (i < ls->count) {
+                patch_remove(ls, i, views, n);
             }
-
-            count++;
         }
-
-        closedir(d);
-        qsort(*list, count, sizeof(**list), elemcmp);
-    } else {
-        return -1;
     }
 
-    *rcount = count;
-    return 0;
+    for (int v = 0; v < n; v++) {
+        struct listing* ls = views[v].ls;
+        if (ls->patched) {
+            struct stat st;
+            ls->patched = false;
+            if (0 == fstat(ls->fd, &st)) {
+                makekey(&ls->key, &st, ls->hidden);
+            } else {
+                ls->key.valid = false;
+            }
+            ls->stats.entries = ls->count;
+            if (ls->garbage > ls->names.len / 2) {
+                listing_compact(ls);
+            }
+        }
+    }
+#else
+    (void)views; (void)n;
+#endif
+    return changed;
 }
 
 /*
@@ -1073,11 +5995,28 @@ static int getkey(void) {
     return -1;
 }
 
+/*
+ * Reads a key while typing into a prompt. When scripting, the end of input
+ * finishes the prompt rather than quitting.
+ */
+static int promptkey(void) {
+    if (!interactive) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) <= 0) {
+            return '\n';
+        }
+        return c;
+    }
+    return getkey();
+}
+
 /*
  * Draws one element to the screen.
  */
 static void drawentry(struct listelem* e, bool selected) {
     if (!interactive) return;
+    resolve(e);
+    const char* name = entryname(shown->names.buf + e->name);
     printf("\033[2K"); // clear line
 
 #if BOLD_POINTER
@@ -1141,18 +6080,18 @@ static void drawentry(struct listelem* e, bool selected) {
 #if INVERT_SELECTION
     if (selected) {
 # if INVERT_FULL_SELECTION
-        printf(" %s%-*s", e->name, cols, E_DIR(e->type) ? "/" : "");
+        printf(" %s%-*s", name, cols, E_DIR(e->type) ? "/" : "");
 # else
-        printf(" \033[7m%s%s", e->name, E_DIR(e->type) ? "/" : "");
+        printf(" \033[7m%s%s", name, E_DIR(e->type) ? "/" : "");
 # endif
     } else {
-        printf(" %s", e->name);
+        printf(" %s", name);
         if (E_DIR(e->type)) {
             printf("/");
         }
     }
 #else
-    printf(" %s", e->name);
+    printf(" %s", name);
     if (E_DIR(e->type)) {
         printf("/");
     }
@@ -1181,8 +6120,32 @@ static void drawstatusline(struct listelem* l, size_t n, size_t s, size_t m, siz
     } else {
         count = printf(" %zu/%zu (%zu marked)", n ? s+1 : n, n, m);
     }
-    // print the type of the file
-    printf("%*s \r", cols-count-1, elemtypestrings[l->type]);
+    if (shown && shown->mode != SORT_NAME) {
+        count += printf(" by %s", sortmodestrings[shown->mode]);
+    }
+    if (scan.job) {
+        count += printf(" loading %zu...", scan.have);
+    }
+    char progress[160];
+    if (job_progress(progress, sizeof(progress))) {
+        count += printf("  %.*s", cols / 2, progress);
+    }
+    // print the type of the file, along with its size if it's a directory
+    // whose size is known
+    char type[64] = "";
+    if (n) {
+        char size[16];
+        struct dusize du;
+        bool running;
+        snprintf(type, sizeof(type), "%s", elemtypestrings[l->type]);
+        if (E_DIR(l->type) && shown
+                && du_get(shown->fd, shown->path, entryname(shown->names.buf + l->name), &du, &running)) {
+            humansize(size, sizeof(size), du.bytes);
+            snprintf(type, sizeof(type), "%s%s in %"PRId64" files  %s",
+                    size, running ? "..." : "", du.files, elemtypestrings[l->type]);
+        }
+    }
+    printf("%*s \r", cols-count-1, type);
     printf("\033[m\n\033[%zu;H", p+2); // move cursor back and reset formatting
 }
 
@@ -1206,11 +6169,28 @@ static void drawstatuslineerror(const char* prefix, const char* error, size_t p)
     printf("\033[m\033[%zu;H", p+2);
 }
 
+/*
+ * Draws the statusline with an informational message in it.
+ */
+static void drawstatuslineinfo(const char* prefix, const char* msg, size_t p) {
+    if (!interactive) {
+        printf("%s: %s\n", prefix, msg);
+        return;
+    }
+
+    printf("\033[%d;H"
+            "\033[37;7;1m",
+            rows);
+    int count = printf(" %s: ", prefix);
+    printf("%-*s \r", cols-count-1, msg);
+    printf("\033[m\033[%zu;H", p+2);
+}
+
 /*
  * Draws the whole screen (redraw).
  * Use sparingly.
  */
-static void drawscreen(char* wd, struct listelem* l, size_t n, size_t s, size_t o, size_t m, int v) {
+static void drawscreen(char* wd, struct listelem* l, const uint32_t* map, size_t n, size_t s, size_t o, size_t m, int v) {
     if (!interactive) return;
 
     // clear the screen except for the top and bottom lines
@@ -1237,13 +6217,41 @@ static void drawscreen(char* wd, struct listelem* l, size_t n, size_t s, size_t
 
     printf("\033[m"); // reset formatting
 
+    // classify what is about to be shown, plus a bit extra either way
+    resolverange(l, map, n, (s - o > LAZY_READAHEAD) ? s - o - LAZY_READAHEAD : 0,
+            s - o + rows - 2 + LAZY_READAHEAD);
+
     for (size_t i = s - o; i < n && (int)(i - (s - o)) < rows - 2; i++) {
         printf("\r\n");
-        drawentry(&(l[i]), (bool)(i == s));
+        drawentry(&(l[map ? map[i] : i]), (bool)(i == s));
     }
 
-    drawstatusline(&(l[s]), n, s, m, o);
+    drawstatusline(&(l[(map && n) ? map[s] : s]), n, s, m, o);
+}
+
+#if FILE_INDEX
+/*
+ * Draws the results of the go-to prompt in place of the listing, with the
+ * selected one s.
+ */
+static void drawgoto(const uint32_t* found, size_t n, size_t s, uint32_t from) {
+    char path[PATH_MAX+1];
+
+    for (int i = 2; i < rows; i++) {
+        printf("\033[%dH"
+                "\033[m"
+                "\033[K", i);
+        if ((size_t)(i - 2) < n) {
+            bool dir = index_get(found[i-2], from, path, sizeof(path));
+            if ((size_t)(i - 2) == s) {
+                printf("%s%s%s", POINTER, path, dir ? "/" : "");
+            } else {
+                printf("%*s%s%s", (int)strlen(POINTER), "", path, dir ? "/" : "");
+            }
+        }
+    }
 }
+#endif
 
 /*
  * Writes back the parent directory of a path.
@@ -1340,6 +6348,19 @@ int main(int argc, char** argv) {
     maketmpdir();
     rmpwdfile();
 
+    // copies and deletes hold a descriptor for every level of the tree
+    // they're in, so allow as many as possible
+    if (0 == getrlimit(RLIMIT_NOFILE, &nofile)) {
+        struct rlimit rl = nofile;
+        rl.rlim_cur = rl.rlim_max;
+#ifdef OPEN_MAX
+        if (rl.rlim_cur > OPEN_MAX) {
+            rl.rlim_cur = OPEN_MAX;
+        }
+#endif
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     char* userhome = getenv("HOME");
     size_t homelen = strlen(userhome);
 
@@ -1394,95 +6415,325 @@ int main(int argc, char** argv) {
     if (tmpdir[0]) {
         atexit(rmtmp);
     }
+    // jobs have to be stopped before the trash is removed
+    atexit(job_stopall);
     atexit(resetterm);
 
-    size_t listsize = LIST_ALLOC_SIZE;
-    struct listelem* list = malloc(LIST_ALLOC_SIZE * sizeof(struct listelem));
-    if (!list) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
+#ifdef __linux__
+    // without this, every change just reads the whole directory again
+    inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+    struct listelem* list = NULL;
 
     bool update = true;
+    bool changed = false;
+    bool switched = false;
     bool showhidden = false;
+    enum sortmode sortby = SORT_NAME;
     size_t newdcount = 0;
     size_t dcount = 0;
+    size_t prevdcount = 0;
+    size_t scansel = 0;
+    bool painted = false;
+    bool scanready = false;
+    bool watchready = false;
+    bool loaded = false;
+    bool reload = false;
+    bool jobsready = false;
+
+    struct deletedfile* delstack = NULL;
+
+    struct view views[VIEW_COUNT];
+
+    for (int i = 0; i < VIEW_COUNT; i++) {
+        views[i] = (struct view){ NULL, NULL, NULL, false, false, 0, 0, NULL, NULL, { "", 0, false, NULL, 0, 0 } };
+    }
+
+    for (int i = 0; i < VIEW_COUNT; i++) {
+        views[i].wd = malloc(PATH_MAX+1);
+        if (!views[i].wd) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strncpy(views[i].wd, wd, PATH_MAX);
+        views[i].ls = listing_new(wd, showhidden, sortby);
+    }
+
+    free(wd);
+
+    // selected view
+    int _view = 0;
+    struct view* view = views;
+
+    if (!tmpdir[0]) {
+        view->errorshown = true;
+        view->eprefix = "Warning";
+        view->emsg = "Trash dir not available";
+    }
+
+    int k = -1, pk = -1, status = 0;
+    char tmpbuf[PATH_MAX+1] = {0};
+    char tmpbuf2[PATH_MAX+1] = {0};
+    char tmpnam[NAME_MAX+1] = {0};
+    char copymsg[128] = {0};
+    char lastname[NAME_MAX+1] = {0};
+    char yankbuf[PATH_MAX+1] = {0};
+    char cutbuf[NAME_MAX+1] = {0};
+    bool hasyanked = false;
+    bool hascut = false;
+    char cutpath[PATH_MAX+1] = {0};
+    while (1&&1) {
+        if (jobsready || !interactive) {
+            // do the bookkeeping for jobs which have finished
+            jobsready = false;
+            for (struct job* j = job_collect(); j; j = job_next(j)) {
+                static const char* errprefixes[] = {
+                    "Error pasting", "Error deleting", "Error cutting", "Error deleting", "Error undoing",
+                };
+                changed = true;
+                redraw = true;
+                if (j->err) {
+                    if (j->kind == JOB_TRASH) {
+                        freedeleted(j->deleted);
+                    } else if (j->kind == JOB_UNDO) {
+                        j->deleted->prev = delstack;
+                        delstack = j->deleted;
+                    }
+                    view->errorshown = true;
+                    if (j->err == ECANCELED) {
+                        view->eprefix = "Cancelled";
+                        view->emsg = jobverbs[j->kind];
+                        view->einfo = true;
+                    } else {
+                        view->eprefix = errprefixes[j->kind];
+                        view->emsg = strerror(j->err);
+                        if (!interactive) {
+                            drawstatuslineerror(view->eprefix, view->emsg, view->pos);
+                        }
+                    }
+                    continue;
+                }
+                switch (j->kind) {
+                    case JOB_PASTE:
+                        index_add(j->dst);
+                        // scripts don't draw anything
+                        if (interactive) {
+                            memcpy(copymsg, j->msg, sizeof(copymsg));
+                            view->eprefix = "Pasted";
+                            view->emsg = copymsg;
+                            view->errorshown = true;
+                            view->einfo = true;
+                        }
+                        break;
+                    case JOB_TRASH:
+                        j->deleted->prev = delstack;
+                        delstack = j->deleted;
+                        index_remove(j->src);
+                        break;
+                    case JOB_CUT:
+                        index_remove(j->src);
+                        snprintf(cutbuf, NAME_MAX, "%s", basename(j->src));
+                        snprintf(cutpath, sizeof(cutpath), "%s", j->dst);
+                        hasyanked = false;
+                        hascut = true;
+                        break;
+                    case JOB_DELETE:
+                        index_remove(j->src);
+                        break;
+                    case JOB_UNDO:
+                        index_add(j->dst);
+                        freedeleted(j->deleted);
+                        break;
+                }
+            }
+        }
+
+        if (switched) {
+            switched = false;
+            // scans only ever fill the listing being shown
+            scan_cancel();
+            if (!view->ls->complete || view->ls->stale || view->ls->hidden != showhidden
+                    || (view->ls->mode != sortby && !listing_sort(view->ls, sortby, views, VIEW_COUNT))) {
+                update = true;
+            } else {
+                shown = view->ls;
+                list = shown->list;
+                dcount = viewcount(view);
+                redraw = true;
+            }
+        }
+
+        if (changed && !update) {
+            // something was done to the directory, so pick up the changes
+            // from the watch if there is one, else read it again
+            if (view->ls->watch >= 0 && !scan.job) {
+                watchready = true;
+            } else {
+                for (int i = 0; i < VIEW_COUNT; i++) {
+                    if (0 == strcmp(views[i].ls->path, view->ls->path)) {
+                        views[i].ls->stale = true;
+                    }
+                }
+                if (lastname[0]) {
+                    view->pos = 0;
+                    view->selection = 0;
+                }
+                update = true;
+            }
+        }
+        changed = false;
 
-    struct deletedfile* delstack = NULL;
+        if (watchready && !update && !scan.job) {
+            if (watch_apply(views, VIEW_COUNT)) {
+                if (view->ls->stale) {
+                    if (lastname[0]) {
+                        view->pos = 0;
+                        view->selection = 0;
+                    }
+                    update = true;
+                } else {
+                    list = view->ls->list;
+                    dcount = viewcount(view);
+                    if (lastname[0]) {
+                        size_t i = findname(view->ls, lastname);
+                        if (view->filter.len && i < view->ls->count) {
+                            size_t j = filter_find(&view->filter, i);
+                            i = (j < dcount && view->filter.idx[j] == i) ? j : dcount;
+                        }
+                        if (i < dcount) {
+                            view_select(view, i);
+                        }
+                    }
+                    redraw = true;
+                }
+            }
+            if (!update) {
+                lastname[0] = 0;
+            }
+        }
+        watchready = false;
 
-    struct view {
-        char* wd;
-        const char* eprefix;
-        const char* emsg;
-        bool errorshown;
-        size_t selection;
-        size_t pos;
-        size_t marks;
-        struct savedpos* backstack;
-    } views[VIEW_COUNT];
+        if (update) {
+            update = false;
+            scan_cancel();
 
-    for (int i = 0; i < VIEW_COUNT; i++) {
-        views[i] = (struct view){ NULL, NULL, NULL, false, 0, 0, 0, NULL };
-    }
+            // another view may already have this directory
+            struct listing* ls = NULL;
+            if (!reload) {
+                ls = listing_find(views, VIEW_COUNT, view, view->wd, showhidden, sortby);
+            }
 
-    for (int i = 0; i < VIEW_COUNT; i++) {
-        views[i].wd = malloc(PATH_MAX+1);
-        if (!views[i].wd) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
-        }
-        strncpy(views[i].wd, wd, PATH_MAX);
-    }
+            if (reload) {
+                view->ls->stale = true;
+            }
+            bool usecache = !view->ls->stale;
 
-    free(wd);
+            // a filter is put back once the directory has been read again,
+            // but is dropped when going somewhere else
+            if (0 == strcmp(view->ls->path, view->wd)) {
+                filter_clear(view);
+            } else {
+                // the selection has already been set for the new directory
+                view->filter.len = 0;
+                view->filter.count = 0;
+                view->filter.str[0] = '\0';
+            }
+            listing_release(view->ls);
+
+            prevdcount = dcount;
+            dcount = 0;
+            if (ls) {
+                ls->refs++;
+                view->ls = ls;
+                loaded = true;
+            } else {
+                view->ls = listing_new(view->wd, showhidden, sortby);
+                scan_start(view->wd, showhidden, sortby, usecache);
+                painted = false;
+                scanready = !interactive;
+            }
+            shown = view->ls;
+            list = shown->list;
+            reload = false;
+        }
 
-    // selected view
-    int _view = 0;
-    struct view* view = views;
+        if (scan.job && scanready) {
+            scanready = false;
 
-    if (!tmpdir[0]) {
-        view->errorshown = true;
-        view->eprefix = "Warning";
-        view->emsg = "Trash dir not available";
-    }
+            // remember the selected file in case it has to be found again
+            char selname[NAME_MAX+1] = {0};
+            if (painted && view->selection != scansel && view->selection < dcount) {
+                strncpy(selname, nameat(view, view->selection), NAME_MAX);
+            }
 
-    int k = -1, pk = -1, status;
-    char tmpbuf[PATH_MAX+1] = {0};
-    char tmpbuf2[PATH_MAX+1] = {0};
-    char tmpnam[NAME_MAX+1] = {0};
-    char lastname[NAME_MAX+1] = {0};
-    char yankbuf[PATH_MAX+1] = {0};
-    char cutbuf[NAME_MAX+1] = {0};
-    bool hasyanked = false;
-    bool hascut = false;
-    int cutid = -1;
-    while (1&&1) {
-        if (update) {
-            update = false;
-            status = listdir(view->wd, &list, &listsize, &newdcount, showhidden);
-            if (0 != status) {
-                parentdir(view->wd);
-                view->errorshown = true;
-                view->eprefix = "Error";
-                view->emsg = strerror(errno);
-                if (view->backstack) {
-                    view->pos = view->backstack->pos;
-                    view->selection = view->backstack->sel;
-                    struct savedpos* s = view->backstack;
-                    view->backstack = s->prev;
-                    free(s);
+            enum scanstate state;
+            do {
+                if (!interactive) {
+                    scan_wait();
                 }
-                update = true;
-                continue;
+                state = scan_collect(view->ls);
+            } while (!interactive && state == SCAN_READING);
+            list = view->ls->list;
+            newdcount = view->ls->count;
+
+            switch (state) {
+                case SCAN_FAILED:
+                    parentdir(view->wd);
+                    view->errorshown = true;
+                    view->eprefix = "Error";
+                    view->emsg = strerror(errno);
+                    if (view->backstack) {
+                        view->pos = view->backstack->pos;
+                        view->selection = view->backstack->sel;
+                        struct savedpos* s = view->backstack;
+                        view->backstack = s->prev;
+                        free(s);
+                    }
+                    update = true;
+                    continue;
+                case SCAN_READING:
+                case SCAN_SORTING:
+                    if (!painted) {
+                        if (newdcount >= view->selection - view->pos + rows - 2) {
+                            painted = true;
+                            scansel = view->selection;
+                            dcount = newdcount;
+                            redraw = true;
+                        }
+                    } else {
+                        dcount = newdcount;
+                        if (!redraw && !view->errorshown) {
+                            drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
+                            printf("\033[%zu;1H", view->pos+2);
+                            fflush(stdout);
+                        }
+                    }
+                    break;
+                case SCAN_DONE:
+                    if (selname[0]) {
+                        // the selection was moved while loading, keep it on
+                        // the same file now that it's sorted
+                        strncpy(lastname, selname, NAME_MAX);
+                        view->pos = 0;
+                        view->selection = 0;
+                    }
+                    loaded = true;
+                    break;
             }
+        }
+
+        if (loaded) {
+            loaded = false;
+            newdcount = view->ls->count;
             if (!newdcount) {
                 view->pos = 0;
                 view->selection = 0;
             } else {
                 // lock to bottom if deleted file at top
-                if (newdcount < dcount) {
+                if (newdcount < prevdcount) {
                     if (view->pos == 0 && view->selection > 0) {
-                        if (dcount - view->selection == (size_t)rows - 2) {
+                        if (prevdcount - view->selection == (size_t)rows - 2) {
                             view->selection--;
                         }
                     }
@@ -1497,7 +6748,7 @@ int main(int argc, char** argv) {
                 }
                 if (view->pos == 0 && view->selection == 0 && lastname[0]) {
                     for (size_t i = 0; i < newdcount; i++) {
-                        if (0 == strcmp(lastname, list[i].name)) {
+                        if (0 == strcmp(lastname, nameof(view->ls, i))) {
                             view->selection = i;
                             view->pos = (i > (size_t)rows - 2) ? (size_t)rows/2 : i;
                             break;
@@ -1506,7 +6757,11 @@ int main(int argc, char** argv) {
                     lastname[0] = 0;
                 }
             }
-            dcount = newdcount;
+            if (view->filter.str[0]) {
+                view->filter.len = strlen(view->filter.str);
+                filter_run(view, false, view->selection);
+            }
+            dcount = viewcount(view);
             redraw = true;
         }
 
@@ -1533,15 +6788,55 @@ int main(int argc, char** argv) {
 
                 resize = false;
             }
-            drawscreen(homesubstwd(view->wd, userhome, homelen), list, dcount, view->selection, view->pos, view->marks, _view);
-            if (view->errorshown) {
+            drawscreen(homesubstwd(view->wd, userhome, homelen), list, viewmap(view), dcount, view->selection, view->pos, view->ls->marks, _view);
+            if (view->errorshown && view->einfo) {
+                drawstatuslineinfo(view->eprefix, view->emsg, view->pos);
+            } else if (view->errorshown) {
                 drawstatuslineerror(view->eprefix, view->emsg, view->pos);
             }
             printf("\033[%zu;1H", view->pos+2);
             fflush(stdout);
         }
 
+        if (interactive) {
+            // wait for a key, or for the directory scan or a job to have news
+            struct pollfd pfds[3] = {
+                { .fd = STDIN_FILENO, .events = POLLIN },
+                { .fd = scan.job ? scanwake[0] : inofd, .events = POLLIN },
+                { .fd = jobwake[0], .events = POLLIN },
+            };
+            // while a directory's size is being computed or a job is
+            // running, keep showing how far it has got
+            bool sizing = du_running() || job_pending();
+            int ready = poll(pfds, 3, sizing ? SCAN_STATUS_MS : -1);
+            if (ready == 0 && sizing && !redraw && !view->errorshown) {
+                drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
+                printf("\033[%zu;1H", view->pos+2);
+                fflush(stdout);
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            if (pfds[1].revents & POLLIN) {
+                if (scan.job) {
+                    scanready = true;
+                } else {
+                    watchready = true;
+                }
+            }
+            if (pfds[2].revents & POLLIN) {
+                jobsready = true;
+            }
+            if (!(pfds[0].revents & POLLIN)) {
+                continue;
+            }
+        }
+
         k = getkey();
+        if (view->einfo) {
+            view->einfo = false;
+            view->errorshown = false;
+        }
         switch(k) {
             case 'h':
                 {
@@ -1564,16 +6859,33 @@ int main(int argc, char** argv) {
                 }
                 break;
             case '\033':
-                if (view->marks > 0) {
-                    view->marks = 0;
-                    update = true;
+                if (view->ls->marks > 0) {
+                    for (size_t i = 0; i < view->ls->count; i++) {
+                        view->ls->list[i].marked = false;
+                    }
+                    view->ls->marks = 0;
+                    redraw = true;
+                    break;
+                }
+                if (view->filter.len) {
+                    filter_clear(view);
+                    view->filter.str[0] = '\0';
+                    dcount = viewcount(view);
+                    redraw = true;
                     break;
                 } // fallthrough
             case 'q':
-                exit(EXIT_SUCCESS);
-                break;
             case 'Q':
-                cdonclose(view->wd);
+                if (job_pending() && pk != k) {
+                    view->eprefix = "Warning";
+                    view->emsg = "Jobs are still running, press again to stop them and quit";
+                    view->errorshown = true;
+                    redraw = true;
+                    break;
+                }
+                if (k == 'Q') {
+                    cdonclose(view->wd);
+                }
                 exit(EXIT_SUCCESS);
                 break;
             case '.':
@@ -1583,12 +6895,247 @@ int main(int argc, char** argv) {
                 update = true;
                 break;
             case 'r':
+                reload = true;
                 update = true;
                 break;
+            case 'f':
+                // narrow what's shown as the filter is typed
+                if (!view->ls->complete) {
+                    break;
+                }
+                while (1) {
+                    drawscreen(homesubstwd(view->wd, userhome, homelen), list, viewmap(view), dcount, view->selection, view->pos, view->ls->marks, _view);
+                    if (interactive) {
+                        drawstatuslineinfo("Filter", view->filter.str, view->pos);
+                        fflush(stdout);
+                    }
+
+                    k = promptkey();
+                    size_t sel = viewindex(view, view->selection);
+                    if (k == '\n' || k == '\r') {
+                        break;
+                    } else if (k == K_ESC) {
+                        filter_clear(view);
+                        view->filter.str[0] = '\0';
+                    } else if (k == 127 || k == '\b') {
+                        if (view->filter.len > 1) {
+                            view->filter.str[--view->filter.len] = '\0';
+                            filter_run(view, false, sel);
+                        } else {
+                            filter_clear(view);
+                            view->filter.str[0] = '\0';
+                        }
+                    } else if (k >= ' ' && k < 127 && view->filter.len < NAME_MAX) {
+                        bool narrow = view->filter.len > 0;
+                        view->filter.str[view->filter.len++] = (char)k;
+                        view->filter.str[view->filter.len] = '\0';
+                        filter_run(view, narrow, sel);
+                    }
+                    dcount = viewcount(view);
+                    if (k == K_ESC) {
+                        break;
+                    }
+                }
+                // the keys were all for the prompt
+                k = -1;
+                view->errorshown = false;
+                redraw = true;
+                break;
+            case 't':
+                // jump to the first entry starting with what's typed
+                {
+                    char prefix[NAME_MAX+1] = {0};
+                    size_t len = 0;
+                    while (1) {
+                        if (interactive) {
+                            drawstatuslineinfo("Jump", prefix, view->pos);
+                            fflush(stdout);
+                        }
+
+                        k = promptkey();
+                        if (k == '\n' || k == '\r' || k == K_ESC) {
+                            break;
+                        } else if (k == 127 || k == '\b') {
+                            if (len) {
+                                prefix[--len] = '\0';
+                            }
+                        } else if (k >= ' ' && k < 127 && len < NAME_MAX) {
+                            prefix[len++] = (char)k;
+                        } else {
+                            continue;
+                        }
+
+                        size_t i = len ? findprefix(view, prefix) : dcount;
+                        if (i < dcount && i != view->selection) {
+                            view_select(view, i);
+                            drawscreen(homesubstwd(view->wd, userhome, homelen), list, viewmap(view), dcount, view->selection, view->pos, view->ls->marks, _view);
+                        }
+                    }
+                }
+                // the keys were all for the prompt
+                k = -1;
+                view->errorshown = false;
+                redraw = true;
+                break;
+#if FILE_INDEX
+            case 'F':
+                // go to any path below here by typing part of it
+                {
+                    if (!index_covers(view->wd, showhidden)) {
+                        index_start(view->wd, showhidden);
+                    }
+
+                    size_t max = (rows > 2) ? (size_t)rows - 2 : 1;
+                    uint32_t* found = malloc(max * sizeof(*found));
+                    if (!found) {
+                        perror("malloc");
+                        exit(EXIT_FAILURE);
+                    }
+
+                    char q[NAME_MAX+1] = {0};
+                    size_t len = 0, sel = 0, indexed;
+                    ssize_t n = 0;
+                    uint32_t from = 0;
+                    if (!interactive) {
+                        // scripts shouldn't depend on how far it got
+                        index_wait();
+                    }
+                    while (1) {
+                        bool done = index_done(&indexed);
+
+                        n = index_query(view->wd, q, found, max, &from);
+                        if (n < 0) {
+                            n = 0;
+                        }
+                        if (sel >= (size_t)n) {
+                            sel = n ? n - 1 : 0;
+                        }
+
+                        if (interactive) {
+                            drawgoto(found, n, sel, from);
+                            snprintf(tmpbuf, PATH_MAX, "Go to (%zu%s)", indexed, done ? "" : " indexed so far");
+                            drawstatuslineinfo(tmpbuf, q, sel);
+                            fflush(stdout);
+
+                            // refresh the results as the index grows
+                            struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+                            if (!done && poll(&pfd, 1, SCAN_STATUS_MS * 2) == 0) {
+                                continue;
+                            }
+                        }
+
+                        k = promptkey();
+                        if (k == K_ESC) {
+                            break;
+                        } else if (k == '\n' || k == '\r') {
+                            if (n > 0) {
+                                size_t wl = strlen(view->wd);
+                                if (view->wd[1] != '\0') {
+                                    view->wd[wl++] = '/';
+                                }
+                                bool dir = index_get(found[sel], from, view->wd + wl, PATH_MAX - wl);
+                                if (!dir) {
+                                    char* slash = strrchr(view->wd, '/');
+                                    strncpy(lastname, slash + 1, NAME_MAX);
+                                    *(slash == view->wd ? slash + 1 : slash) = '\0';
+                                }
+                                view->selection = 0;
+                                view->pos = 0;
+                                update = true;
+                            }
+                            break;
+                        } else if (k == 14) { // ^N
+                            if (sel + 1 < (size_t)n) {
+                                sel++;
+                            }
+                        } else if (k == 16) { // ^P
+                            if (sel) {
+                                sel--;
+                            }
+                        } else if (k == 127 || k == '\b') {
+                            if (len) {
+                                q[--len] = '\0';
+                            }
+                            sel = 0;
+                        } else if (k >= ' ' && k < 127 && len < NAME_MAX) {
+                            q[len++] = (char)k;
+                            sel = 0;
+                        }
+                    }
+                    free(found);
+                }
+                // the keys were all for the prompt
+                k = -1;
+                view->errorshown = false;
+                redraw = true;
+                break;
+#endif
+            case 'c':
+                if (!dcount) {
+                    break;
+                }
+                snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
+                if (!E_DIR(elemat(view, view->selection)->type)) {
+                    struct stat st;
+                    if (0 != lstat(tmpbuf, &st)) {
+                        view->errorshown = true;
+                        view->eprefix = "Error";
+                        view->emsg = strerror(errno);
+                        drawstatuslineerror(view->eprefix, view->emsg, view->pos);
+                        break;
+                    }
+                    humansize(tmpbuf2, PATH_MAX, (int64_t)st.st_blocks * 512);
+                    drawstatuslineinfo("Size", tmpbuf2, view->pos);
+                    break;
+                }
+                if (!du_start(tmpbuf)) {
+                    view->errorshown = true;
+                    view->eprefix = "Error";
+                    view->emsg = strerror(errno);
+                    drawstatuslineerror(view->eprefix, view->emsg, view->pos);
+                    break;
+                }
+                if (!interactive) {
+                    du_wait();
+                    humansize(tmpbuf2, PATH_MAX, atomic_load(&dujob->bytes));
+                    snprintf(tmpbuf2 + strlen(tmpbuf2), PATH_MAX - strlen(tmpbuf2),
+                            " in %"PRId64" files", (int64_t)atomic_load(&dujob->files));
+                    drawstatuslineinfo("Size", tmpbuf2, view->pos);
+                    break;
+                }
+                view->errorshown = false;
+                drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
+                break;
+            case 's':
+                sortby = (sortby + 1) % SORT_MODES;
+                if (view->ls->complete && !view->ls->stale
+                        && listing_sort(view->ls, sortby, views, VIEW_COUNT)) {
+                    redraw = true;
+                } else if (!view->ls->complete || view->ls->stale) {
+                    update = true;
+                } else {
+                    // sizes and times have to be read first
+                    if (view->selection < dcount) {
+                        strncpy(lastname, nameat(view, view->selection), NAME_MAX);
+                    }
+                    view->selection = 0;
+                    view->pos = 0;
+                    update = true;
+                }
+                break;
+            case 'i':
+                snprintf(tmpbuf, PATH_MAX,
+                        "%zu entries, %zu getdents, %zu fstatat (%zu saved)%s",
+                        view->ls->stats.entries, view->ls->stats.getdents, view->ls->stats.stats,
+                        (view->ls->stats.entries + view->ls->stats.links > view->ls->stats.stats)
+                            ? view->ls->stats.entries + view->ls->stats.links - view->ls->stats.stats : 0,
+                        view->ls->stats.cached ? ", cached" : "");
+                drawstatuslineinfo("Listed", tmpbuf, view->pos);
+                break;
             case 'S':
                 if (shell[0]) {
                     execcmd(view->wd, shell, NULL);
-                    update = true;
+                    changed = true;
                 }
                 break;
 #if VIEW_COUNT > 1
@@ -1606,7 +7153,7 @@ int main(int argc, char** argv) {
                 if (k - '1' < VIEW_COUNT) {
                     _view = k - '1';
                     view = &(views[_view]);
-                    update = true;
+                    switched = true;
                 }
                 break;
             case '`':
@@ -1615,31 +7162,35 @@ int main(int argc, char** argv) {
                     _view = VIEW_COUNT - 1;
                 }
                 view = &(views[_view]);
-                update = true;
+                switched = true;
                 break;
             case '\t':
                 _view = (_view + 1) % VIEW_COUNT;
                 view = &(views[_view]);
-                update = true;
+                switched = true;
                 break;
 #endif
             case 'u':
                 if (tmpdir[0] && delstack != NULL) {
-                    int did = 0;
+                    bool mass = delstack->mass;
+                    int did = delstack->massid;
                     do {
-                        did = delstack->massid;
-                        snprintf(tmpbuf, PATH_MAX, "%s/%d", tmpdir, delstack->id);
-                        if (0 != cpfile(tmpbuf, delstack->original)) {
-                            view->eprefix = "Error undoing";
-                            view->emsg = strerror(errno);
-                            view->errorshown = true;
-                        } else {
-                            // fail silently here
-                            unlink(tmpbuf);
-                            delstack = freedeleted(delstack);
-                        }
-                    } while (delstack && delstack->mass && delstack->massid == did);
-                    update = 1;
+                        struct deletedfile* d = delstack;
+                        delstack = d->prev;
+                        snprintf(tmpbuf, PATH_MAX, "%s/%d", d->trash, d->id);
+                        job_push(JOB_UNDO, tmpbuf, d->original, d);
+                    } while (mass && delstack && delstack->mass && delstack->massid == did);
+                }
+                break;
+            case 'C':
+                // scripts run each job to the end before going on, so there's
+                // never one to cancel
+                if (interactive && !job_cancel()) {
+                    view->eprefix = "Cancel";
+                    view->emsg = job_pending() ? "Too late to cancel this job" : "No job is running";
+                    view->errorshown = true;
+                    view->einfo = true;
+                    drawstatuslineinfo(view->eprefix, view->emsg, view->pos);
                 }
                 break;
             case 'T':
@@ -1687,12 +7238,11 @@ int main(int argc, char** argv) {
                         }
                     } else {
                         fclose(f);
+                        index_add(tmpbuf);
                         strncpy(lastname, tmpnam, NAME_MAX);
-                        view->pos = 0;
-                        view->selection = 0;
                     }
                 }
-                update = true;
+                changed = true;
                 break;
             case 'M':
                 status = readfname(tmpnam, "new directory name");
@@ -1731,16 +7281,20 @@ int main(int argc, char** argv) {
                         view->emsg = strerror(errno);
                         view->errorshown = true;
                     }
+                } else {
+                    index_add(tmpbuf);
                 }
-                update = true;
+                changed = true;
                 break;
             case 'p':
                 if (hasyanked) {
                     strncpy(tmpbuf, yankbuf, PATH_MAX);
                     snprintf(tmpbuf2, PATH_MAX, "%s/%s", view->wd, basename(yankbuf));
                 } else if (hascut) {
-                    snprintf(tmpbuf, PATH_MAX, "%s/%d", tmpdir, cutid);
+                    snprintf(tmpbuf, PATH_MAX, "%s", cutpath);
                     snprintf(tmpbuf2, PATH_MAX, "%s/%s", view->wd, cutbuf);
+                } else {
+                    break;
                 }
                 bool didpaste = true;
                 do {
@@ -1783,11 +7337,7 @@ int main(int argc, char** argv) {
                     }
                     int s = exists(tmpbuf2);
                     if (s == 0) {
-                        if (0 != cpfile(tmpbuf, tmpbuf2)) {
-                            view->eprefix = "Error";
-                            view->emsg = "Could not copy files";
-                            view->errorshown = true;
-                        }
+                        job_push(JOB_PASTE, tmpbuf, tmpbuf2, NULL);
                         didpaste = true;
                     } else if (s == -1) {
                         view->eprefix = "Error";
@@ -1799,7 +7349,7 @@ int main(int argc, char** argv) {
                     }
                 } while (!didpaste);
 outofloop:
-                update = true;
+                changed = true;
                 break;
         }
 
@@ -1813,29 +7363,33 @@ outofloop:
             case 'j':
                 if (view->selection < dcount - 1) {
                     view->errorshown = false;
-                    drawentry(&(list[view->selection]), false);
+                    drawentry(elemat(view, view->selection), false);
                     view->selection++;
+                    resolverange(list, viewmap(view), dcount, view->selection, view->selection + LAZY_READAHEAD);
                     printf("\n");
-                    drawentry(&(list[view->selection]), true);
+                    drawentry(elemat(view, view->selection), true);
                     if (view->pos < (size_t)rows - 3) {
                         view->pos++;
                     }
-                    drawstatusline(&(list[view->selection]), dcount, view->selection, view->marks, view->pos);
+                    drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
                 }
                 break;
             case 'k':
                 if (view->selection > 0) {
                     view->errorshown = false;
-                    drawentry(&(list[view->selection]), false);
+                    drawentry(elemat(view, view->selection), false);
                     view->selection--;
+                    resolverange(list, viewmap(view), dcount,
+                            (view->selection > LAZY_READAHEAD) ? view->selection - LAZY_READAHEAD : 0,
+                            view->selection + 1);
                     if (view->pos > 0) {
                         view->pos--;
                         printf("\r\033[A");
                     } else {
                         printf("\r\033[L");
                     }
-                    drawentry(&(list[view->selection]), true);
-                    drawstatusline(&(list[view->selection]), dcount, view->selection, view->marks, view->pos);
+                    drawentry(elemat(view, view->selection), true);
+                    drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
                 }
                 break;
             case KEY_PGDN:
@@ -1876,12 +7430,12 @@ outofloop:
                     view->selection = 0;
                     redraw = true;
                 } else {
-                    drawentry(&(list[view->selection]), false);
+                    drawentry(elemat(view, view->selection), false);
                     view->pos = 0;
                     view->selection = 0;
                     printf("\033[%zu;1H", view->pos+2);
-                    drawentry(&(list[view->selection]), true);
-                    drawstatusline(&(list[view->selection]), dcount, view->selection, view->marks, view->pos);
+                    drawentry(elemat(view, view->selection), true);
+                    drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
                 }
                 break;
             case 'G':
@@ -1898,23 +7452,23 @@ outofloop:
             case '\n':
 #endif
             case 'l':
-                if (E_DIR(list[view->selection].type)) {
+                if (E_DIR(elemat(view, view->selection)->type)) {
                     struct savedpos* sp = malloc(sizeof(struct savedpos));
                     sp->pos = view->pos;
-                    sp->sel = view->selection;
+                    sp->sel = viewindex(view, view->selection);
                     sp->prev = view->backstack;
                     view->backstack = sp;
                     if (view->wd[1] != '\0') {
                         strcat(view->wd, "/");
                     }
-                    strncat(view->wd, list[view->selection].name, PATH_MAX - strlen(view->wd) - 2);
+                    strncat(view->wd, nameat(view, view->selection), PATH_MAX - strlen(view->wd) - 2);
                     view->selection = 0;
                     view->pos = 0;
                     update = true;
                 } else {
                     if (editor[0]) {
-                        execcmd(view->wd, editor, list[view->selection].name);
-                        update = true;
+                        execcmd(view->wd, editor, nameat(view, view->selection));
+                        changed = true;
                     }
                 }
                 view->errorshown = false;
@@ -1923,24 +7477,24 @@ outofloop:
             case '\n':
 #endif
             case 'o':
-                if (E_DIR(list[view->selection].type)) {
+                if (E_DIR(elemat(view, view->selection)->type)) {
                     struct savedpos* sp = malloc(sizeof(struct savedpos));
                     sp->pos = view->pos;
-                    sp->sel = view->selection;
+                    sp->sel = viewindex(view, view->selection);
                     sp->prev = view->backstack;
                     view->backstack = sp;
                     if (view->wd[1] != '\0') {
                         strcat(view->wd, "/");
                     }
-                    strncat(view->wd, list[view->selection].name, PATH_MAX - strlen(view->wd) - 2);
+                    strncat(view->wd, nameat(view, view->selection), PATH_MAX - strlen(view->wd) - 2);
                     view->selection = 0;
                     view->pos = 0;
                     update = true;
                     break;
                 } else if (opener[0]) {
                     if (opener[0]) {
-                        execcmd(view->wd, opener, list[view->selection].name);
-                        update = true;
+                        execcmd(view->wd, opener, nameat(view, view->selection));
+                        changed = true;
                     }
                 }
                 view->errorshown = false;
@@ -1951,117 +7505,63 @@ outofloop:
                     break;
                 }
                 if (interactive && k == 'd' && tmpdir[0]) {
-                    if (NULL == delstack) {
-                        delstack = newdeleted(false);
-                    } else {
-                        struct deletedfile* d = newdeleted(false);
-                        d->prev = delstack;
-                        delstack = d;
-                    }
-
-                    snprintf(delstack->original, PATH_MAX, "%s/%s", view->wd, list[view->selection].name);
-
-                    snprintf(tmpbuf, PATH_MAX, "%s/%d", tmpdir, delstack->id);
-                    if (0 != cpfile(delstack->original, tmpbuf)) {
-                        view->eprefix = "Error deleting";
-                        view->emsg = strerror(errno);
-                        view->errorshown = true;
-                        delstack = freedeleted(delstack);
-                    } else {
-                        if (0 != del(delstack->original)) {
-                            view->eprefix = "Error deleting";
-                            view->emsg = strerror(errno);
-                            view->errorshown = true;
-                            delstack = freedeleted(delstack);
-                        } else {
-                            if (list[view->selection].marked) {
-                                view->marks--;
-                            }
-                        }
-                    }
+                    // the undo stack only gets it once it's in the trash
+                    struct deletedfile* d = newdeleted(false);
+                    snprintf(d->original, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
+                    d->trash = trashfor(d->original);
+                    snprintf(tmpbuf, PATH_MAX, "%s/%d", d->trash, d->id);
+                    job_push(JOB_TRASH, d->original, tmpbuf, d);
                 } else {
-                    snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, list[view->selection].name);
-                    if (0 != del(tmpbuf)) {
-                        view->eprefix = "Error deleting";
-                        view->emsg = strerror(errno);
-                        view->errorshown = true;
-                    } else {
-                        if (list[view->selection].marked) {
-                            view->marks--;
-                        }
-                    }
+                    snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
+                    job_push(JOB_DELETE, tmpbuf, NULL, NULL);
                 }
-                update = true;
                 break;
             case 'D':
-                if (!view->marks) {
+                if (!view->ls->marks) {
                     break;
                 }
-                for (size_t i = 0; i < dcount; i++) {
-                    if (list[i].marked) {
+                // marks hidden by a filter count too. They're cleared once
+                // the deletions are queued, so that they aren't queued twice
+                for (size_t i = 0; i < view->ls->count; i++) {
+                    if (view->ls->list[i].marked) {
+                        view->ls->list[i].marked = false;
                         if (tmpdir[0]) {
-                            if (NULL == delstack) {
-                                delstack = newdeleted(true);
-                            } else {
-                                struct deletedfile* d = newdeleted(true);
-                                d->prev = delstack;
-                                delstack = d;
-                            }
-
-                            snprintf(delstack->original, PATH_MAX, "%s/%s", view->wd, list[i].name);
-
-                            snprintf(tmpbuf, PATH_MAX, "%s/%d", tmpdir, delstack->id);
-                            if (0 != cpfile(delstack->original, tmpbuf)) {
-                                view->eprefix = "Error copying for deletion";
-                                view->emsg = strerror(errno);
-                                view->errorshown = true;
-                                delstack = freedeleted(delstack);
-                            } else {
-                                if (0 != del(delstack->original)) {
-                                    view->eprefix = "Error deleting";
-                                    view->emsg = strerror(errno);
-                                    view->errorshown = true;
-                                    delstack = freedeleted(delstack);
-                                } else {
-                                    view->marks--;
-                                }
-                            }
+                            struct deletedfile* d = newdeleted(true);
+                            snprintf(d->original, PATH_MAX, "%s/%s", view->wd, nameof(view->ls, i));
+                            d->trash = trashfor(d->original);
+                            snprintf(tmpbuf, PATH_MAX, "%s/%d", d->trash, d->id);
+                            job_push(JOB_TRASH, d->original, tmpbuf, d);
                         } else {
-                            snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, list[i].name);
-                            if (0 != del(tmpbuf)) {
-                                view->eprefix = "Error deleting";
-                                view->emsg = strerror(errno);
-                                view->errorshown = true;
-                            } else {
-                                view->marks--;
-                            }
+                            snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, nameof(view->ls, i));
+                            job_push(JOB_DELETE, tmpbuf, NULL, NULL);
                         }
                     }
                 }
+                view->ls->marks = 0;
                 if (tmpdir[0]) {
                     mdel_id++;
                 }
-                update = true;
+                redraw = true;
                 break;
             case 'e':
                 if (editor[0]) {
-                    execcmd(view->wd, editor, list[view->selection].name);
-                    update = true;
+                    execcmd(view->wd, editor, nameat(view, view->selection));
+                    changed = true;
                 }
                 break;
             case ' ':
             case 'm':
-                list[view->selection].marked = !(list[view->selection].marked);
-                if (list[view->selection].marked) {
-                    view->marks++;
+                elemat(view, view->selection)->marked = !(elemat(view, view->selection)->marked);
+                if (elemat(view, view->selection)->marked) {
+                    view->ls->marks++;
                 } else {
-                    view->marks--;
+                    view->ls->marks--;
                 }
-                drawstatusline(&(list[view->selection]), dcount, view->selection, view->marks, view->pos);
-                drawentry(&(list[view->selection]), true);
+                drawstatusline(elemat(view, view->selection), dcount, view->selection, view->ls->marks, view->pos);
+                drawentry(elemat(view, view->selection), true);
                 break;
             case 'R':
-                status = readfname(tmpnam, list[view->selection].name);
+                status = readfname(tmpnam, nameat(view, view->selection));
                 switch (status) {
                     case -1:
                         view->eprefix = "Error";
@@ -2096,16 +7596,15 @@ outofloop:
                         view->errorshown = true;
                     } else if (s == 0) {
                         // the target file does not exist
-                        snprintf(tmpbuf2, PATH_MAX, "%s/%s", view->wd, list[view->selection].name);
+                        snprintf(tmpbuf2, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
                         if (-1 == rename(tmpbuf2, tmpbuf)) {
                             view->eprefix = "Error";
                             view->emsg = strerror(errno);
                             view->errorshown = true;
                         } else {
+                            index_rename(tmpbuf2, tmpbuf);
                             // go find the new file and select it
                             strncpy(lastname, tmpnam, NAME_MAX);
-                            view->pos = 0;
-                            view->selection = 0;
                         }
                     } else if (s == -1) {
                         view->eprefix = "Error";
@@ -2113,43 +7612,27 @@ outofloop:
                         view->errorshown = true;
                     }
                 }
-                update = true;
+                changed = true;
                 break;
             case 'y':
                 if (pk != 'y') {
                     break;
                 }
-                snprintf(yankbuf, PATH_MAX, "%s/%s", view->wd, list[view->selection].name);
+                snprintf(yankbuf, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
                 hasyanked = true;
                 break;
             case 'X':
-                if (tmpbuf[0]) {
-                    snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, list[view->selection].name);
-                    snprintf(cutbuf, NAME_MAX, "%s", list[view->selection].name);
-                    snprintf(tmpbuf2, PATH_MAX, "%s/%d", tmpdir, (cutid = del_id++));
-                    if (0 != cpfile(tmpbuf, tmpbuf2)) {
-                        view->eprefix = "Error";
-                        view->emsg = strerror(errno);
-                        view->errorshown = true;
-                    } else {
-                        if (0 != del(tmpbuf)) {
-                            view->eprefix = "Error";
-                            view->emsg = "Couldn't delete original file";
-                            view->errorshown = true;
-                        } else {
-                            if (list[view->selection].marked) {
-                                view->marks--;
-                            }
-                        }
-                        hasyanked = false;
-                        hascut = true;
-                    }
+                if (tmpdir[0]) {
+                    // it can be pasted once it's in the trash
+                    snprintf(tmpbuf, PATH_MAX, "%s/%s", view->wd, nameat(view, view->selection));
+                    snprintf(tmpbuf2, PATH_MAX, "%s/%d", trashfor(tmpbuf), del_id++);
+                    job_push(JOB_CUT, tmpbuf, tmpbuf2, NULL);
                 } else {
                     view->eprefix = "Error";
                     view->emsg = "No tmp dir, cannot cut!";
                     view->errorshown = true;
+                    changed = true;
                 }
-                update = true;
                 break;
             case '~':
                 if (userhome) {
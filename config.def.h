@@ -49,6 +49,12 @@
  * Note that cfm will not allow you to mark or delete its
  * temp directory.
  *
+ * Files deleted or cut from another filesystem are kept in a
+ * hidden .cfmtrash-<pid> directory made at the top of that
+ * filesystem (or as near to it as cfm can write), so that they
+ * are only ever renamed rather than copied. These are removed
+ * along with the temp directory when cfm exits.
+ *
  * Default: "/tmp/cfmtmp"
  * Value: string
  */
@@ -171,4 +177,58 @@
  */
 //#define ABBREVIATE_HOME 1
 
+/* LAZY_STAT:
+ * If set, cfm will not stat regular files when reading a directory, and will
+ * instead only check whether they are executable once they are about to be
+ * shown on screen. This makes large directories (especially on network
+ * mounts) open much faster. If set to 0, all files will be checked up front.
+ *
+ * Default: 1
+ * Value: boolean (1 or 0)
+ */
+//#define LAZY_STAT 1
+
+/* CACHE_SIZE:
+ * The amount of memory, in megabytes, which cfm may use to keep the listings
+ * of directories you have left, so that going back to one which hasn't
+ * changed doesn't require reading it again. Set to 0 to disable.
+ *
+ * Default: 64
+ * Value: integer
+ */
+//#define CACHE_SIZE 64
+
+/* FILE_INDEX:
+ * If set, F will index the tree below the current directory in the background
+ * and let you jump to any file or directory in it by typing part of its path.
+ * The index is kept up to date with changes made from within cfm. Set to 0 to
+ * leave out the index entirely.
+ *
+ * Default: 1
+ * Value: boolean (1 or 0)
+ */
+//#define FILE_INDEX 1
+
+/* COPY_THREADS:
+ * The most threads cfm will use to copy a directory, whether pasting it or
+ * moving it in or out of the trash. More than one lets slow disks and network
+ * filesystems have several files on the go at once. Set to 1 to copy one file
+ * at a time.
+ *
+ * Default: 8
+ * Value: integer (1-64)
+ */
+//#define COPY_THREADS 8
+
+/* IO_URING:
+ * If set, cfm will copy small files in batches through io_uring on Linux,
+ * which takes a handful of system calls per batch instead of several per
+ * file. It falls back to copying normally if the kernel doesn't allow it.
+ * Has no effect where the kernel headers don't have io_uring.
+ *
+ * Default: 1
+ * Value: boolean (1 or 0)
+ */
+//#define IO_URING 1
+
 #endif